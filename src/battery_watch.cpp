@@ -1,18 +1,46 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include "brightness_utils/protocol.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <system_error>
 #include <thread>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <boost/program_options.hpp>
+#include <fcntl.h>
 #include <libudev.h>
+#include <nlohmann/json.hpp>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
 
 namespace BatteryWatch {
 
@@ -20,8 +48,50 @@ namespace BatteryWatch {
 
     using namespace std::chrono_literals;
 
+    using jsn = nlohmann::json;
+
     static const fs::path kPowerState{"/sys/power/state"};
-    static constexpr auto kCooldownTime = 5s;
+
+    // A jump of CLOCK_BOOTTIME against CLOCK_MONOTONIC above this means that the system was suspended.
+    static constexpr auto kResumeJump = 500ms;
+
+    // Time after a resume before the policy may enter a sleep state again, so that the user can
+    // act and the status can catch up with a charger that was plugged in during sleep.
+    static constexpr std::chrono::seconds kResumeGrace{60};
+
+    static const fs::path kPolicyConfigPath{"/etc/battery-watch.conf"};
+    static const fs::path kBrightnessSocket{"/run/brightness.sock"};
+
+    // Time after which a missing reply of the brightness daemon is given up on.
+    static constexpr std::chrono::milliseconds kBrightnessReplyTimeout{1000};
+
+    // Default re-evaluation interval in event mode, for firmware that doesn't emit uevents.
+    static constexpr unsigned kFallbackInterval{600};
+
+    // Enough for any power_supply status string or 32-bit value.
+    static constexpr std::size_t kAttributeBufferSize{32};
+
+    // Bounds for the adaptive polling interval (in seconds).
+    static constexpr unsigned kMinInterval{10};
+    static constexpr unsigned kMaxInterval{1800};
+
+    // Number of samples kept in the history, about a day with the default fallback interval.
+    static constexpr std::size_t kHistorySize{256};
+
+    static constexpr std::uint32_t kHistoryMagic{0x53485742}; // "BWHS"
+    static constexpr std::uint16_t kHistoryVersion{1};
+
+    // Time constant of the power estimate.
+    static constexpr std::chrono::seconds kPowerTimeConstant{300};
+
+    // Wake up after this fraction of the projected time until the next stage fires.
+    static constexpr double kSafetyFactor{0.5};
+
+    // Polling interval while not discharging, so that unplugging is noticed without uevents.
+    static constexpr std::chrono::seconds kIdleInterval{120};
+
+    // Samples per fallback interval in event mode, while the power estimate is built up.
+    static constexpr unsigned kEstimateSamples{10};
 
     static auto make_device(struct ::udev_device *device) {
         auto deleter = [](struct ::udev_device *device) { ::udev_device_unref(device); };
@@ -51,19 +121,315 @@ namespace BatteryWatch {
         return output;
     }
 
-    static void sys_suspend() {
+    /**
+     * Persistent file descriptor for a sysfs attribute.
+     *
+     * Reads go through a single pread() at offset zero into a caller-provided
+     * buffer, which avoids reopening the attribute on every poll.
+     */
+    class AttributeFD {
+    public:
+        AttributeFD() = default;
+
+        AttributeFD([[maybe_unused]] const AttributeFD &rhs) = delete;
+        void operator=([[maybe_unused]] const AttributeFD &rhs) = delete;
+
+        AttributeFD(AttributeFD &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+        ~AttributeFD() {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        void open(const fs::path &path) {
+            fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd_ < 0) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+
+        /**
+         * Read the attribute, without the trailing newline.
+         *
+         * @param buffer Storage for the value, the result points into it
+         */
+        template<std::size_t N>
+        std::string_view read(std::array<char, N> &buffer) const {
+            const auto ret = ::pread(fd_, buffer.data(), buffer.size(), 0);
+            if (ret < 0) {
+                throw std::system_error(errno, std::generic_category());
+            }
+
+            std::string_view value{buffer.data(), static_cast<std::size_t>(ret)};
+
+            if (!value.empty() && value.back() == '\n') {
+                value.remove_suffix(1);
+            }
+
+            return value;
+        }
+
+        unsigned read_unsigned() const {
+            std::array<char, kAttributeBufferSize> buffer;
+
+            return to_unsigned(read(buffer));
+        }
+
+        /**
+         * Read a signed attribute, e.g. current_now or power_now, which are
+         * negative while discharging on many drivers.
+         */
+        std::int64_t read_signed() const {
+            std::array<char, kAttributeBufferSize> buffer;
+
+            const auto input = read(buffer);
+
+            std::int64_t output{};
+
+            const auto result = std::from_chars(input.data(), input.data() + input.size(), output);
+            if (result.ec != std::errc()) {
+                throw std::system_error(static_cast<int>(result.ec), std::generic_category());
+            }
+
+            return output;
+        }
+
+    private:
+        int fd_{-1};
+    };
+
+    static std::uint64_t clock_ns(::clockid_t clock);
+
+    /**
+     * Get the time spent in suspend since boot.
+     */
+    static std::chrono::nanoseconds suspend_time() {
+        return std::chrono::nanoseconds{clock_ns(CLOCK_BOOTTIME) - clock_ns(CLOCK_MONOTONIC)};
+    }
+
+    /**
+     * Wait until one of some file descriptors becomes readable.
+     *
+     * @param fds     The file descriptors, negative ones are ignored
+     * @param timeout Maximum time to wait
+     *
+     * @return true if a file descriptor is readable, false on timeout or signal
+     */
+    static bool wait_readable(std::initializer_list<int> fds, std::chrono::milliseconds timeout) {
+        std::vector<struct ::pollfd> pfds;
+
+        for (const auto fd : fds) {
+            pfds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+        }
+
+        const auto ret = ::poll(pfds.data(), pfds.size(), static_cast<int>(timeout.count()));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                return false;
+            }
+
+            throw std::system_error(errno, std::generic_category());
+        }
+
+        return ret != 0;
+    }
+
+    static void sys_suspend(std::string_view mode) {
         std::ofstream stream;
 
         stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
         stream.open(kPowerState);
 
-        stream << "mem";
+        stream << mode;
         stream.flush();
         stream.close();
+    }
+
+    /**
+     * Start a process without waiting for it.
+     *
+     * @param args Program (looked up in PATH) and its arguments
+     *
+     * The child has to be reaped later with reap_children().
+     */
+    static void spawn(const std::vector<std::string> &args) {
+        std::vector<char *> argv;
+
+        for (const auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.data()));
+        }
+
+        argv.push_back(nullptr);
 
-        std::this_thread::sleep_for(kCooldownTime);
+        ::pid_t pid;
+
+        const auto ret = ::posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+        if (ret != 0) {
+            throw std::system_error(ret, std::generic_category());
+        }
+    }
+
+    static void reap_children() {
+        while (true) {
+            int status;
+
+            const auto pid = ::waitpid(-1, &status, WNOHANG);
+            if (pid <= 0) {
+                break;
+            }
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "warn: action process " << pid << " failed" << std::endl;
+            }
+        }
     }
 
+    /**
+     * Fixed-size ring buffer, which overwrites the oldest element when full.
+     */
+    template<typename T, std::size_t N>
+    class RingBuffer {
+    public:
+        void push(const T &value) {
+            data_[pos_] = value;
+
+            pos_  = (pos_ + 1) % N;
+            size_ = std::min(size_ + 1, N);
+        }
+
+        std::size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        /**
+         * Access an element, where index zero is the oldest one.
+         */
+        const T &operator[](std::size_t index) const {
+            return data_[(pos_ + N - size_ + index) % N];
+        }
+
+        const T &back() const {
+            return data_[(pos_ + N - 1) % N];
+        }
+
+    private:
+        std::array<T, N> data_{};
+
+        std::size_t pos_{0};
+        std::size_t size_{0};
+    };
+
+    /**
+     * Aggregated battery sample, also the record format of the history file.
+     *
+     * Timestamps use CLOCK_BOOTTIME, so that time spent in suspend is accounted for.
+     */
+    struct HistorySample {
+        std::uint64_t timestamp_ns;
+        std::uint32_t energy_now;
+        std::uint32_t power_now;
+        std::uint8_t  state;
+        std::uint8_t  reserved[3];
+    } __attribute__((packed));
+
+    /**
+     * Header of the history file, followed by the samples (oldest first).
+     *
+     * Both clocks are sampled at dump time, so that the sample timestamps can be
+     * converted to wall clock time offline.
+     */
+    struct HistoryHeader {
+        std::uint32_t magic;
+        std::uint16_t version;
+        std::uint16_t sample_size;
+        std::uint32_t count;
+        std::uint32_t energy_full;
+        std::uint64_t boottime_ns;
+        std::uint64_t realtime_ns;
+    } __attribute__((packed));
+
+    // Set from the SIGUSR1 handler, the history is dumped on the next evaluation.
+    static volatile std::sig_atomic_t dump_requested{0};
+
+    static std::uint64_t clock_ns(::clockid_t clock) {
+        struct ::timespec ts;
+
+        if (::clock_gettime(clock, &ts) != 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
+    }
+
+    /**
+     * Single battery of the system, with its attributes kept open.
+     */
+    struct BatteryDevice {
+        std::string name{};
+
+        AttributeFD status_attr{};
+        AttributeFD full_attr{};
+        AttributeFD now_attr{};
+        AttributeFD power_attr{};
+
+        // Converts charge (in µAh) to energy (in µWh), one if the battery reports energy.
+        double energy_scale{1.0};
+
+        double energy_full{0.0};
+
+        bool has_power{false};
+
+        /**
+         * Open the attributes of a power_supply device.
+         *
+         * Batteries report either charge or energy, which is probed only once here.
+         * Charge is converted with the design voltage, so that batteries of both
+         * kinds can be aggregated. The same applies to current vs. power.
+         */
+        void open(struct ::udev_device *device) {
+            name = ::udev_device_get_sysname(device);
+
+            const fs::path syspath{::udev_device_get_syspath(device)};
+
+            const auto use_energy = get_sysattr_value(device, "charge_full").empty();
+
+            status_attr.open(syspath / "status");
+            full_attr.open(syspath / (use_energy ? "energy_full" : "charge_full"));
+            now_attr.open(syspath / (use_energy ? "energy_now" : "charge_now"));
+
+            if (!use_energy) {
+                const auto voltage = get_sysattr_value(device, "voltage_min_design");
+
+                // µV to V, without the design voltage the plain charge is used.
+                energy_scale = voltage.empty() ? 1.0 : to_unsigned(voltage) / 1000000.0;
+            }
+
+            const auto power_name = use_energy ? "power_now" : "current_now";
+
+            // Not every battery reports it, the power is then derived from the energy.
+            has_power = !get_sysattr_value(device, power_name).empty();
+
+            if (has_power) {
+                power_attr.open(syspath / power_name);
+            }
+
+            refresh();
+        }
+
+        void refresh() {
+            energy_full = full_attr.read_unsigned() * energy_scale;
+
+            if (energy_full <= 0.0) {
+                throw std::system_error(EINVAL, std::generic_category());
+            }
+        }
+    };
+
     class BatteryContext {
     private:
         enum class State : unsigned {
@@ -73,14 +439,15 @@ namespace BatteryWatch {
         };
 
     public:
-        BatteryContext(const std::string &device) : udev_ctx_(::udev_new()), device_name_(device) {
+        /**
+         * @param devices Names of the batteries to watch, all batteries of the system if empty
+         */
+        BatteryContext(const std::vector<std::string> &devices) : udev_ctx_(::udev_new()), device_names_(devices) {
             if (udev_ctx_ == nullptr) {
                 throw std::system_error(ENOMEM, std::generic_category());
             }
 
-            if (device_name_.empty()) {
-                throw std::system_error(EINVAL, std::generic_category());
-            }
+            resolve();
         }
 
         ~BatteryContext() {
@@ -89,74 +456,1027 @@ namespace BatteryWatch {
             }
         }
 
+        /**
+         * Re-read the full capacity of the batteries.
+         *
+         * The value only changes with battery wear or after a recalibration, which
+         * the kernel reports with a change uevent. A battery that went away (e.g.
+         * a dock battery) makes the set of batteries to be discovered again.
+         */
+        void refresh() {
+            try {
+                for (auto &battery : batteries_) {
+                    battery.refresh();
+                }
+            } catch (const std::system_error &) {
+                resolve();
+            }
+        }
+
         void poll() {
-            auto device = make_device(::udev_device_new_from_subsystem_sysname(udev_ctx_, "power_supply", device_name_.data()));
-            if (!device) {
+            try {
+                sample();
+            } catch (const std::system_error &) {
+                resolve();
+                sample();
+            }
+
+            record();
+        }
+
+        /**
+         * Projected time until the battery is empty, if it is discharging.
+         */
+        std::optional<std::chrono::seconds> time_to_empty() const {
+            return time_to_level(0.0f);
+        }
+
+        /**
+         * Projected time until the battery is full, if it is charging.
+         */
+        std::optional<std::chrono::seconds> time_to_full() const {
+            if (state_ != State::Charging || power_estimate_ <= 0.0) {
+                return std::nullopt;
+            }
+
+            return std::chrono::seconds{static_cast<long>((energy_full_ - energy_now_) / power_estimate_ * 3600.0)};
+        }
+
+        /**
+         * Projected time until the battery drops to a level, if it is discharging.
+         *
+         * @param treshold The level (in percentage)
+         */
+        std::optional<std::chrono::seconds> time_to_level(float treshold) const {
+            if (state_ != State::Discharging || power_estimate_ <= 0.0) {
+                return std::nullopt;
+            }
+
+            const auto remaining = std::max(energy_now_ - energy_full_ * treshold / 100.0, 0.0);
+
+            // Energy in µWh and power in µW, so this is in hours.
+            return std::chrono::seconds{static_cast<long>(remaining / power_estimate_ * 3600.0)};
+        }
+
+        bool is_discharging() const {
+            return state_ == State::Discharging;
+        }
+
+        bool is_critical(float treshold) const {
+            // If we are below half the treshold, ignore the charging state and
+            // signal critical state directly.
+            if (charge_level_ * 100.0f < treshold * 0.5f) {
+                return true;
+            }
+
+            if (state_ != State::Discharging) {
+                return false;
+            }
+
+            return charge_level_ * 100.0f < treshold;
+        }
+
+        /**
+         * Is the projected time until the battery is empty below a limit?
+         *
+         * @param minutes The limit
+         */
+        bool is_critical(std::chrono::minutes minutes) const {
+            const auto remaining = time_to_empty();
+
+            return remaining.has_value() && remaining.value() < minutes;
+        }
+
+        /**
+         * Write the sample history to a file, for offline analysis.
+         *
+         * @param path Path of the history file
+         */
+        void dump_history(const fs::path &path) const {
+            const HistoryHeader header{
+                .magic       = kHistoryMagic,
+                .version     = kHistoryVersion,
+                .sample_size = sizeof(HistorySample),
+                .count       = static_cast<std::uint32_t>(history_.size()),
+                .energy_full = static_cast<std::uint32_t>(energy_full_),
+                .boottime_ns = clock_ns(CLOCK_BOOTTIME),
+                .realtime_ns = clock_ns(CLOCK_REALTIME),
+            };
+
+            auto tmp_path = path;
+            tmp_path += ".tmp";
+
+            {
+                std::ofstream stream;
+
+                stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+                stream.open(tmp_path, std::ios::binary | std::ios::trunc);
+
+                stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+                for (std::size_t i = 0; i < history_.size(); ++i) {
+                    stream.write(reinterpret_cast<const char *>(&history_[i]), sizeof(HistorySample));
+                }
+            }
+
+            fs::rename(tmp_path, path);
+        }
+
+    private:
+        /**
+         * Discover the batteries with a single udev enumeration.
+         */
+        void resolve() {
+            auto enumerate = ::udev_enumerate_new(udev_ctx_);
+            if (enumerate == nullptr) {
+                throw std::system_error(ENOMEM, std::generic_category());
+            }
+
+            auto deleter = [](struct ::udev_enumerate *enumerate) { ::udev_enumerate_unref(enumerate); };
+            std::unique_ptr<struct ::udev_enumerate, decltype(deleter)> enumerate_guard(enumerate, deleter);
+
+            ::udev_enumerate_add_match_subsystem(enumerate, "power_supply");
+            ::udev_enumerate_add_match_sysattr(enumerate, "type", "Battery");
+
+            auto ret = ::udev_enumerate_scan_devices(enumerate);
+            if (ret < 0) {
+                throw std::system_error(-ret, std::generic_category());
+            }
+
+            std::vector<BatteryDevice> batteries;
+
+            struct ::udev_list_entry *entry;
+
+            udev_list_entry_foreach(entry, ::udev_enumerate_get_list_entry(enumerate)) {
+                auto device = make_device(::udev_device_new_from_syspath(udev_ctx_, ::udev_list_entry_get_name(entry)));
+                if (!device) {
+                    continue;
+                }
+
+                const std::string_view sysname{::udev_device_get_sysname(device.get())};
+
+                if (!device_names_.empty() && std::find(device_names_.cbegin(), device_names_.cend(), sysname) == device_names_.cend()) {
+                    continue;
+                }
+
+                // Batteries of peripherals (e.g. mice or gamepads) don't power the system.
+                if (get_sysattr_value(device.get(), "scope") == std::string_view{"Device"}) {
+                    continue;
+                }
+
+                BatteryDevice battery;
+
+                try {
+                    battery.open(device.get());
+                } catch (const std::system_error &err) {
+                    std::cerr << "warn: skipping battery: " << sysname << ": " << err.what() << std::endl;
+
+                    continue;
+                }
+
+                batteries.push_back(std::move(battery));
+            }
+
+            for (const auto &name : device_names_) {
+                const auto found = std::any_of(batteries.cbegin(), batteries.cend(), [&name](const auto &battery) { return battery.name == name; });
+
+                if (!found) {
+                    std::cerr << "warn: battery not available: " << name << std::endl;
+                }
+            }
+
+            if (batteries.empty()) {
                 throw std::system_error(ENODEV, std::generic_category());
             }
 
-            std::string_view attrval;
+            batteries_ = std::move(batteries);
 
-            attrval = get_sysattr_value(device.get(), "status");
+            for (const auto &battery : batteries_) {
+                std::cout << "info: watching battery: " << battery.name << std::endl;
+            }
+        }
+
+        /**
+         * Compute the energy-weighted level and the combined state of all batteries.
+         *
+         * The system is charging if any battery charges, since that implies external
+         * power. Otherwise it is discharging if any battery discharges, e.g. when the
+         * firmware drains the batteries one after the other.
+         */
+        void sample() {
+            double energy_now{0.0}, energy_full{0.0}, power_now{0.0};
+
+            bool any_charging{false}, any_discharging{false}, has_power{true};
+
+            for (const auto &battery : batteries_) {
+                std::array<char, kAttributeBufferSize> buffer;
+
+                const auto status = battery.status_attr.read(buffer);
+
+                if (status == std::string_view{"Charging"}) {
+                    any_charging = true;
+                } else if (status == std::string_view{"Discharging"}) {
+                    any_discharging = true;
+                }
+
+                energy_now += battery.now_attr.read_unsigned() * battery.energy_scale;
+                energy_full += battery.energy_full;
 
-            if (attrval == std::string_view{"Charging"}) {
+                if (battery.has_power) {
+                    // Only the magnitude matters, the direction follows from the status.
+                    power_now += std::abs(battery.power_attr.read_signed()) * battery.energy_scale;
+                } else {
+                    has_power = false;
+                }
+            }
+
+            if (any_charging) {
                 state_ = State::Charging;
-            } else if (attrval == std::string_view{"Discharging"}) {
+            } else if (any_discharging) {
                 state_ = State::Discharging;
             } else {
                 state_ = State::Unknown;
             }
 
-            bool use_energy = false;
-            unsigned charge_full{}, charge_now{};
+            if (energy_now <= 0.0 || energy_full <= 0.0) {
+                throw std::system_error(EINVAL, std::generic_category());
+            }
+
+            energy_now_   = energy_now;
+            energy_full_  = energy_full;
+            power_now_    = has_power ? std::optional<double>{power_now} : std::nullopt;
+            charge_level_ = static_cast<float>(energy_now / energy_full);
+        }
+
+        /**
+         * Append the current sample to the history and update the power estimate.
+         *
+         * The estimate is an exponentially weighted average with a time constant,
+         * so irregular sampling intervals are handled. It restarts whenever the
+         * state changes, since charging and discharging power are unrelated.
+         */
+        void record() {
+            const auto now = clock_ns(CLOCK_BOOTTIME);
+
+            const auto has_previous = !history_.empty() && history_.back().state == static_cast<std::uint8_t>(state_);
 
-            attrval = get_sysattr_value(device.get(), "charge_full");
+            double power{0.0};
 
-            if (attrval.empty()) {
-                use_energy = true;
+            if (power_now_.has_value()) {
+                power = power_now_.value();
+            } else if (has_previous) {
+                const auto &previous = history_.back();
+
+                const auto elapsed_h = (now - previous.timestamp_ns) / 3600.0e9;
+                if (elapsed_h > 0.0) {
+                    power = std::abs(energy_now_ - previous.energy_now) / elapsed_h;
+                }
+            }
+
+            if (state_ == State::Unknown) {
+                power_estimate_ = 0.0;
+            } else if (!has_previous || power_estimate_ <= 0.0) {
+                power_estimate_ = power;
             } else {
-                charge_full = to_unsigned(attrval);
+                const auto elapsed_s = (now - history_.back().timestamp_ns) / 1.0e9;
+                const auto alpha = 1.0 - std::exp(-elapsed_s / kPowerTimeConstant.count());
 
-                attrval = get_sysattr_value(device.get(), "charge_now");
-                charge_now = to_unsigned(attrval);
+                power_estimate_ += alpha * (power - power_estimate_);
             }
 
-            if (use_energy) {
-                attrval = get_sysattr_value(device.get(), "energy_full");
-                charge_full = to_unsigned(attrval);
+            history_.push(HistorySample{
+                .timestamp_ns = now,
+                .energy_now   = static_cast<std::uint32_t>(energy_now_),
+                .power_now    = static_cast<std::uint32_t>(power),
+                .state        = static_cast<std::uint8_t>(state_),
+                .reserved     = {},
+            });
+        }
+
+        struct ::udev *udev_ctx_;
+
+        std::vector<std::string> device_names_{};
+        std::vector<BatteryDevice> batteries_{};
+
+        State state_{State::Unknown};
+        float charge_level_{-1.0f};
+
+        // Aggregated values, in µWh and µW.
+        double energy_now_{0.0};
+        double energy_full_{0.0};
+        std::optional<double> power_now_{};
+        double power_estimate_{0.0};
+
+        RingBuffer<HistorySample, kHistorySize> history_{};
+    };
 
-                attrval = get_sysattr_value(device.get(), "energy_now");
-                charge_now = to_unsigned(attrval);
+    /**
+     * Monitor for power_supply uevents.
+     *
+     * Charge and status changes of batteries, as well as plugging or unplugging
+     * the AC adapter, are reported by the kernel as change events.
+     */
+    class MonitorContext {
+    public:
+        MonitorContext() : udev_ctx_(::udev_new()) {
+            if (udev_ctx_ == nullptr) {
+                throw std::system_error(ENOMEM, std::generic_category());
             }
+        }
 
-            if (charge_full == 0 || charge_now == 0) {
-                throw std::system_error(EINVAL, std::generic_category());
+        ~MonitorContext() {
+            if (monitor_ != nullptr) {
+                ::udev_monitor_unref(monitor_);
             }
 
-            charge_level_ = float(charge_now) / float(charge_full);
+            ::udev_unref(udev_ctx_);
         }
 
-        bool is_critical(float treshold) const {
-            // If we are below half the treshold, ignore the charging state and
-            // signal critical state directly.
-            if (charge_level_ * 100.0f < treshold * 0.5f) {
-                return true;
+        void init() {
+            monitor_ = ::udev_monitor_new_from_netlink(udev_ctx_, "udev");
+            if (monitor_ == nullptr) {
+                throw std::system_error(ENOMEM, std::generic_category());
             }
 
-            if (state_ != State::Discharging) {
+            auto ret = ::udev_monitor_filter_add_match_subsystem_devtype(monitor_, "power_supply", nullptr);
+            if (ret < 0) {
+                throw std::system_error(-ret, std::generic_category());
+            }
+
+            ret = ::udev_monitor_enable_receiving(monitor_);
+            if (ret < 0) {
+                throw std::system_error(-ret, std::generic_category());
+            }
+        }
+
+        /**
+         * Wait for power supply events.
+         *
+         * @param timeout  Maximum time to wait
+         * @param wake_fds Additional file descriptors that end the wait early (negative ones are ignored)
+         *
+         * @return true if at least one event was received, false on timeout
+         *
+         * All queued events are consumed, so that a burst results in a single re-evaluation.
+         */
+        bool wait(std::chrono::milliseconds timeout, std::initializer_list<int> wake_fds) {
+            std::vector<struct ::pollfd> pfds{
+                {.fd = ::udev_monitor_get_fd(monitor_), .events = POLLIN, .revents = 0},
+            };
+
+            for (const auto fd : wake_fds) {
+                pfds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+            }
+
+            const auto ret = ::poll(pfds.data(), pfds.size(), static_cast<int>(timeout.count()));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    return false;
+                }
+
+                throw std::system_error(errno, std::generic_category());
+            }
+
+            if (ret == 0 || (pfds[0].revents & POLLIN) == 0) {
                 return false;
             }
 
-            return charge_level_ * 100.0f < treshold;
+            bool received{false};
+
+            // The monitor socket is non-blocking, so this stops once the queue is empty.
+            while (auto device = make_device(::udev_monitor_receive_device(monitor_))) {
+                received = true;
+            }
+
+            return received;
         }
 
     private:
         struct ::udev *udev_ctx_;
+        struct ::udev_monitor *monitor_{nullptr};
+    };
 
-        std::string device_name_{};
+    /**
+     * Single action of a policy stage.
+     */
+    struct PolicyAction {
+        enum class Type : unsigned {
+            Dim,
+            Powerlimit,
+            Notify,
+            Suspend,
+            Hibernate,
+        };
 
-        State state_{State::Unknown};
-        float charge_level_{-1.0f};
+        Type type{Type::Suspend};
+
+        // Upper bound for the brightness for Dim.
+        std::uint32_t value{0};
+
+        // Profile name for Powerlimit, summary for Notify.
+        std::string argument{};
+
+        // Body and (optional) icon for Notify.
+        std::string body{};
+        std::string icon{};
+
+        void parse(const jsn &input) {
+            const auto type_name = input.at("type").get<std::string>();
+
+            if (type_name == "dim") {
+                type  = Type::Dim;
+                value = input.at("value").get<std::uint32_t>();
+            } else if (type_name == "powerlimit") {
+                type     = Type::Powerlimit;
+                argument = input.at("profile").get<std::string>();
+            } else if (type_name == "notify") {
+                type     = Type::Notify;
+                argument = input.at("summary").get<std::string>();
+                body     = input.at("body").get<std::string>();
+
+                if (input.contains("icon")) {
+                    icon = input.at("icon").get<std::string>();
+                }
+            } else if (type_name == "suspend") {
+                type = Type::Suspend;
+            } else if (type_name == "hibernate") {
+                type = Type::Hibernate;
+            } else {
+                throw std::system_error(EINVAL, std::generic_category());
+            }
+        }
+
+        bool is_sleep() const {
+            return type == Type::Suspend || type == Type::Hibernate;
+        }
+    };
+
+    /**
+     * Group of actions that is triggered when the battery drops below a treshold.
+     */
+    struct PolicyStage {
+        // Either a level (in percentage), or the projected time until the battery is empty.
+        float treshold{0.0f};
+        std::chrono::minutes minutes{0};
+
+        std::vector<PolicyAction> actions{};
+
+        // Set while the battery is critical with respect to this stage.
+        bool active{false};
+
+        void parse(const jsn &input) {
+            if (input.contains("minutes")) {
+                minutes = std::chrono::minutes{input.at("minutes").get<unsigned>()};
+                if (minutes.count() == 0) {
+                    throw std::system_error(EINVAL, std::generic_category());
+                }
+            } else {
+                treshold = input.at("treshold").get<float>();
+                if (treshold <= 0.0f || treshold >= 100.0f) {
+                    throw std::system_error(EINVAL, std::generic_category());
+                }
+            }
+
+            for (const auto &action : input.at("actions")) {
+                PolicyAction policy_action;
+
+                policy_action.parse(action);
+
+                actions.push_back(std::move(policy_action));
+            }
+        }
+
+        bool is_time_based() const {
+            return minutes.count() != 0;
+        }
+
+        /**
+         * Is the battery critical with respect to this stage?
+         *
+         * The time estimate fluctuates with the load, so a time-based stage is
+         * only left once the battery stops discharging.
+         */
+        bool is_critical(const BatteryContext &battery_ctx) const {
+            if (!is_time_based()) {
+                return battery_ctx.is_critical(treshold);
+            }
+
+            if (active) {
+                return battery_ctx.is_discharging();
+            }
+
+            return battery_ctx.is_critical(minutes);
+        }
+
+        std::string label() const {
+            if (is_time_based()) {
+                return std::to_string(minutes.count()) + " min";
+            }
+
+            return std::to_string(treshold) + " %";
+        }
+    };
+
+    /**
+     * Staged low battery policy.
+     *
+     * Each stage fires once when the battery becomes critical with respect to
+     * its treshold, and is reverted (where possible) once it isn't anymore, e.g.
+     * when the AC adapter is plugged in. Actions never block the caller: helpers
+     * are spawned, brightness requests are non-blocking datagrams, and the
+     * write to /sys/power/state (which only returns after resume) happens on a
+     * worker thread. Dimming needs the current brightness, so it is finished
+     * by the evaluation after the reply of the brightness daemon arrived.
+     */
+    class PolicyEngine {
+    public:
+        PolicyEngine() : wake_fd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+            if (wake_fd_ < 0) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+
+        PolicyEngine([[maybe_unused]] const PolicyEngine &rhs) = delete;
+        void operator=([[maybe_unused]] const PolicyEngine &rhs) = delete;
+
+        ~PolicyEngine() {
+            if (worker_.joinable()) {
+                worker_.join();
+            }
+
+            if (sock_fd_ >= 0) {
+                ::close(sock_fd_);
+            }
+
+            ::close(wake_fd_);
+        }
+
+        /**
+         * File descriptor that becomes readable after a resume from a sleep state
+         * entered by the policy. The caller should wait on it and evaluate again
+         * right away.
+         */
+        int wakeFD() const {
+            return wake_fd_;
+        }
+
+        /**
+         * File descriptor that becomes readable when the brightness daemon replies.
+         * The caller should wait on it and evaluate again right away, which finishes
+         * pending dim actions. Negative while no brightness request was made yet.
+         */
+        int replyFD() const {
+            return sock_fd_;
+        }
+
+        /**
+         * Read the policy from a config file.
+         */
+        void read(const fs::path &path) {
+            if (!fs::is_regular_file(path)) {
+                throw std::system_error(ENOENT, std::generic_category());
+            }
+
+            std::ifstream config_file(path);
+            if (!config_file.good()) {
+                throw std::system_error(EACCES, std::generic_category());
+            }
+
+            const auto config_data = jsn::parse(config_file);
+
+            if (config_data.contains("brightness-socket")) {
+                brightness_socket_ = config_data.at("brightness-socket").get<std::string>();
+            }
+
+            if (config_data.contains("notify-user")) {
+                notify_user_ = config_data.at("notify-user").get<std::string>();
+            }
+
+            std::vector<PolicyStage> stages;
+
+            for (const auto &stage : config_data.at("stages")) {
+                PolicyStage policy_stage;
+
+                policy_stage.parse(stage);
+
+                stages.push_back(std::move(policy_stage));
+            }
+
+            // Stages are expected in the order in which they fire.
+            if (stages.empty()) {
+                throw std::system_error(EINVAL, std::generic_category());
+            }
+
+            // Only replace the stages once the whole config is valid, so that a fallback policy can still be used.
+            stages_ = std::move(stages);
+        }
+
+        /**
+         * Use the legacy policy, i.e. suspend to RAM below the treshold.
+         */
+        void fromTreshold(float treshold) {
+            PolicyStage stage;
+
+            stage.treshold = treshold;
+            stage.actions.push_back(PolicyAction{});
+
+            stages_.push_back(std::move(stage));
+        }
+
+        void evaluate(const BatteryContext &battery_ctx) {
+            reap_children();
+            receiveBrightness();
+
+            std::uint64_t value;
+
+            // Consume a pending resume notification, this is the fresh evaluation it asked for.
+            if (::read(wake_fd_, &value, sizeof(value)) > 0) {
+                std::cout << "info: evaluating battery state after resume" << std::endl;
+
+                resume_grace_ = std::chrono::steady_clock::now() + kResumeGrace;
+            }
+
+            if (resume_grace_.has_value() && std::chrono::steady_clock::now() >= resume_grace_.value()) {
+                resume_grace_.reset();
+            }
+
+            // Revert in reverse order, so that e.g. the brightness is restored to the value before the first dim.
+            for (auto it = stages_.rbegin(); it != stages_.rend(); ++it) {
+                if (it->active && !it->is_critical(battery_ctx)) {
+                    std::cout << "info: leaving battery stage: " << it->label() << std::endl;
+
+                    it->active = false;
+
+                    for (const auto &action : it->actions) {
+                        run(action, false);
+                    }
+                }
+            }
+
+            for (auto &stage : stages_) {
+                if (!stage.is_critical(battery_ctx)) {
+                    continue;
+                }
+
+                if (!stage.active) {
+                    std::cout << "info: entering battery stage: " << stage.label() << std::endl;
+
+                    stage.active = true;
+
+                    for (const auto &action : stage.actions) {
+                        run(action, true);
+                    }
+                } else {
+                    // Sleep is repeated after resume (and the grace period) while the battery is still critical.
+                    for (const auto &action : stage.actions) {
+                        if (action.is_sleep()) {
+                            run(action, true);
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * Compute the time until the next evaluation is needed.
+         *
+         * @param battery_ctx The battery context
+         * @param min         Lower bound for the result
+         * @param max         Upper bound for the result
+         * @param uevents     Changes of the charging state wake the caller (event mode)
+         *
+         * The result is a fraction of the projected time until the next stage
+         * fires, so the schedule gets denser as the battery approaches it. In
+         * event mode, plugging or unplugging AC always emits a uevent, so there
+         * is no need to poll for it and max is used instead. After a resume, the
+         * result doesn't extend past the grace period.
+         */
+        std::chrono::seconds nextInterval(const BatteryContext &battery_ctx, std::chrono::seconds min, std::chrono::seconds max, bool uevents) const {
+            const auto interval = projectedInterval(battery_ctx, min, max, uevents);
+
+            if (!resume_grace_.has_value()) {
+                return interval;
+            }
+
+            // Evaluate again when the grace period is over, a sleep state might be due then.
+            const auto grace_left = std::chrono::ceil<std::chrono::seconds>(resume_grace_.value() - std::chrono::steady_clock::now());
+
+            return std::min(std::max(grace_left, std::chrono::seconds{1}), interval);
+        }
+
+    private:
+        struct DimState {
+            std::uint32_t from;
+            std::uint32_t to;
+        };
+
+        // Dim or undim that waits for the current brightness.
+        struct PendingBrightness {
+            const PolicyAction *action;
+            bool                enter;
+            DimState            state;
+        };
+
+        std::chrono::seconds projectedInterval(const BatteryContext &battery_ctx, std::chrono::seconds min, std::chrono::seconds max, bool uevents) const {
+            const auto stage = std::find_if(stages_.cbegin(), stages_.cend(), [](const auto &stage) { return !stage.active; });
+
+            // Keep checking whether the active stages can be left.
+            if (stage == stages_.cend()) {
+                return uevents ? max : min;
+            }
+
+            if (!battery_ctx.is_discharging()) {
+                return uevents ? max : std::clamp(std::chrono::seconds{kIdleInterval}, min, max);
+            }
+
+            std::optional<std::chrono::seconds> remaining;
+
+            if (stage->is_time_based()) {
+                const auto time_to_empty = battery_ctx.time_to_empty();
+                if (time_to_empty.has_value()) {
+                    remaining = std::max(time_to_empty.value() - std::chrono::seconds{stage->minutes}, std::chrono::seconds{0});
+                }
+            } else {
+                remaining = battery_ctx.time_to_level(stage->treshold);
+            }
+
+            // No estimate yet, sample again soon to build it up.
+            if (!remaining.has_value()) {
+                return uevents ? std::max(max / kEstimateSamples, min) : min;
+            }
+
+            const auto projected = std::min(remaining.value().count() * kSafetyFactor, double(max.count()));
+
+            return std::clamp(std::chrono::seconds{static_cast<long>(projected)}, min, max);
+        }
+
+        void run(const PolicyAction &action, bool enter) {
+            using Type = PolicyAction::Type;
+
+            try {
+                switch (action.type) {
+                    case Type::Dim:
+                        enter ? dim(action) : undim(action);
+                        break;
+
+                    case Type::Powerlimit:
+                        spawn({"systemctl", enter ? "start" : "stop", std::string{"cpu-powerlimit@"} + action.argument + ".service"});
+                        break;
+
+                    case Type::Notify:
+                        if (enter) {
+                            notify(action);
+                        }
+                        break;
+
+                    case Type::Suspend:
+                        if (enter && !resume_grace_.has_value()) {
+                            sleep("mem");
+                        }
+                        break;
+
+                    case Type::Hibernate:
+                        if (enter && !resume_grace_.has_value()) {
+                            sleep("disk");
+                        }
+                        break;
+                }
+            } catch (const std::exception &err) {
+                std::cerr << "warn: battery action failed: " << err.what() << std::endl;
+            }
+        }
+
+        void notify(const PolicyAction &action) {
+            if (notify_user_.empty()) {
+                throw std::system_error(EINVAL, std::generic_category());
+            }
+
+            // notify_wrapper looks up the session of its effective user.
+            std::vector<std::string> args{"runuser", "-u", notify_user_, "--", "notify_wrapper", action.argument, action.body};
+
+            if (!action.icon.empty()) {
+                args.push_back(action.icon);
+            }
+
+            spawn(args);
+        }
+
+        /**
+         * Lower the brightness to at most a value.
+         *
+         * The previous value is kept here, not in the save slot of the brightness
+         * daemon, which belongs to its interactive clients.
+         */
+        void dim(const PolicyAction &action) {
+            queueBrightness(PendingBrightness{.action = &action, .enter = true, .state = {}});
+        }
+
+        /**
+         * Undo a dim, unless the brightness was changed since.
+         */
+        void undim(const PolicyAction &action) {
+            // A dim that is still waiting for the current brightness is just dropped.
+            if (std::erase_if(pending_, [&action](const auto &pending) { return pending.action == &action && pending.enter; }) != 0) {
+                return;
+            }
+
+            const auto it = dimmed_.find(&action);
+            if (it == dimmed_.end()) {
+                return;
+            }
+
+            const auto state = it->second;
+
+            dimmed_.erase(it);
+
+            queueBrightness(PendingBrightness{.action = &action, .enter = false, .state = state});
+        }
+
+        void setBrightness(std::uint32_t value) {
+            using namespace BrightnessDaemon;
+
+            const SetStateFrame set_state{.type = CommandType::SetState, .len = sizeof(std::uint32_t), .value = value};
+
+            sendBrightness(&set_state, sizeof(set_state));
+        }
+
+        /**
+         * Queue a dim or undim until the current brightness is known.
+         *
+         * A single query of the primary backlight serves all queued changes.
+         */
+        void queueBrightness(const PendingBrightness &pending) {
+            using namespace BrightnessDaemon;
+
+            if (!reply_deadline_.has_value()) {
+                const CommandFrame get_state{.type = CommandType::GetState, .len = 0};
+
+                sendBrightness(&get_state, sizeof(get_state));
+
+                reply_deadline_ = std::chrono::steady_clock::now() + kBrightnessReplyTimeout;
+            }
+
+            pending_.push_back(pending);
+        }
+
+        /**
+         * Finish the queued brightness changes, if the brightness daemon replied.
+         */
+        void receiveBrightness() {
+            using namespace BrightnessDaemon;
+
+            if (sock_fd_ < 0) {
+                return;
+            }
+
+            std::optional<std::uint32_t> current;
+
+            StateReplyFrame reply;
+
+            // Also drops replies that arrived after a query was given up on.
+            while (true) {
+                const auto ret = ::recv(sock_fd_, &reply, sizeof(reply), 0);
+                if (ret < 0) {
+                    break;
+                }
+
+                if (static_cast<std::size_t>(ret) == sizeof(reply) && reply.type == CommandType::GetState) {
+                    current = static_cast<std::uint32_t>(reply.current);
+                }
+            }
+
+            if (!reply_deadline_.has_value()) {
+                return;
+            }
+
+            if (!current.has_value()) {
+                if (std::chrono::steady_clock::now() >= reply_deadline_.value()) {
+                    std::cerr << "warn: battery action failed: no reply from brightness daemon" << std::endl;
+
+                    pending_.clear();
+                    reply_deadline_.reset();
+                }
+
+                return;
+            }
+
+            reply_deadline_.reset();
+
+            auto value = current.value();
+
+            for (const auto &pending : std::exchange(pending_, {})) {
+                try {
+                    if (pending.enter) {
+                        if (value > pending.action->value) {
+                            setBrightness(pending.action->value);
+
+                            dimmed_[pending.action] = DimState{.from = value, .to = pending.action->value};
+                            value = pending.action->value;
+                        }
+                    } else if (value == pending.state.to) {
+                        setBrightness(pending.state.from);
+
+                        value = pending.state.from;
+                    }
+                } catch (const std::exception &err) {
+                    std::cerr << "warn: battery action failed: " << err.what() << std::endl;
+                }
+            }
+        }
+
+        void sendBrightness(const void *data, std::size_t size) {
+            if (sock_fd_ < 0) {
+                sock_fd_ = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (sock_fd_ < 0) {
+                    throw std::system_error(errno, std::generic_category());
+                }
+
+                const struct ::sockaddr_un local{.sun_family = AF_UNIX, .sun_path = {}};
+
+                // Autobind to an abstract address, so that the daemon can send replies.
+                if (::bind(sock_fd_, reinterpret_cast<const struct ::sockaddr *>(&local), sizeof(local.sun_family)) != 0) {
+                    const auto err = errno;
+
+                    ::close(sock_fd_);
+                    sock_fd_ = -1;
+
+                    throw std::system_error(err, std::generic_category());
+                }
+            }
+
+            struct ::sockaddr_un addr{};
+
+            addr.sun_family = AF_UNIX;
+            brightness_socket_.string().copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+            const auto ret = ::sendto(sock_fd_, data, size, 0, reinterpret_cast<const struct ::sockaddr *>(&addr), sizeof(addr));
+            if (ret < 0) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+
+        void sleep(std::string_view mode) {
+            if (sleeping_.load(std::memory_order_acquire)) {
+                return;
+            }
+
+            if (worker_.joinable()) {
+                worker_.join();
+            }
+
+            std::cout << "info: battery level critical, entering sleep state: " << mode << std::endl;
+
+            sleeping_.store(true, std::memory_order_relaxed);
+
+            worker_ = std::thread([this, mode]() {
+                bool resumed{false};
+
+                try {
+                    const auto before = suspend_time();
+
+                    sys_suspend(mode);
+
+                    // The write also returns without sleeping, e.g. if a device refused to suspend.
+                    resumed = suspend_time() - before > kResumeJump;
+                } catch (const std::exception &err) {
+                    std::cerr << "warn: failed to enter sleep state: " << err.what() << std::endl;
+                }
+
+                sleeping_.store(false, std::memory_order_release);
+
+                // Only wake the loop after an actual resume, so that a failing suspend isn't retried in a tight loop.
+                if (resumed) {
+                    const std::uint64_t value{1};
+
+                    if (::write(wake_fd_, &value, sizeof(value)) < 0) {
+                        std::cerr << "warn: failed to signal resume: " << std::strerror(errno) << std::endl;
+                    }
+                }
+            });
+        }
+
+        fs::path    brightness_socket_{kBrightnessSocket};
+        std::string notify_user_{};
+
+        std::vector<PolicyStage> stages_{};
+
+        int sock_fd_{-1};
+
+        // Brightness before each active dim action.
+        std::map<const PolicyAction *, DimState> dimmed_{};
+
+        std::vector<PendingBrightness> pending_{};
+
+        // Set while a brightness query is outstanding.
+        std::optional<std::chrono::steady_clock::time_point> reply_deadline_{};
+
+        // End of the grace period after a resume, while sleep actions are held back.
+        std::optional<std::chrono::steady_clock::time_point> resume_grace_{};
+
+        int wake_fd_;
+
+        std::thread worker_{};
+        std::atomic<bool> sleeping_{false};
     };
 
 } // namespace BatteryWatch
@@ -168,8 +1488,14 @@ int main(int argc, char *argv[]) {
     desc.add_options()
         ("help,h", "display help message")
         ("interval,i", po::value<unsigned>(), "polling interval (in seconds)")
+        ("event-mode,e", "re-evaluate on power supply uevents instead of polling")
+        ("fallback,f", po::value<unsigned>(), "re-evaluation interval in event mode (in seconds)")
+        ("adaptive,a", "derive the polling interval from the discharge rate")
+        ("max-interval,m", po::value<unsigned>(), "upper bound for the adaptive polling interval (in seconds)")
         ("treshold,t", po::value<float>(), "low battery treshold (in percentage)")
-        ("device,d", po::value<std::string>(), "battery device name");
+        ("config,c", po::value<std::string>()->implicit_value(BatteryWatch::kPolicyConfigPath), "staged policy config (the treshold is only used if it can't be read)")
+        ("device,d", po::value<std::vector<std::string>>(), "battery device name (repeatable, all batteries if omitted)")
+        ("history-file,H", po::value<std::string>(), "file that the sample history is written to on SIGUSR1");
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -181,49 +1507,147 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    if (vm.count("interval") == 0) {
+    const auto event_mode = vm.count("event-mode") != 0;
+    const auto adaptive = vm.count("adaptive") != 0;
+
+    if (!event_mode && !adaptive && vm.count("interval") == 0) {
         std::cerr << "error: missing interval argument" << std::endl;
         std::cout << desc << std::endl;
 
         return 1;
     }
 
-    if (vm.count("treshold") == 0) {
+    const auto use_config = vm.count("config") != 0;
+    const auto use_treshold = vm.count("treshold") != 0;
+
+    if (!use_config && !use_treshold) {
         std::cerr << "error: missing treshold argument" << std::endl;
         std::cout << desc << std::endl;
 
         return 2;
     }
 
-    if (vm.count("device") == 0) {
-        std::cerr << "error: missing device argument" << std::endl;
-        std::cout << desc << std::endl;
+    if (use_treshold) {
+        const auto treshold = vm["treshold"].as<float>();
+        if (treshold <= 5.0f || treshold >= 95.0f) {
+            std::cerr << "error: invalid treshold argument: " << treshold << std::endl;
+            std::cout << desc << std::endl;
 
-        return 3;
+            return 4;
+        }
     }
 
-    const auto treshold = vm["treshold"].as<float>();
-    if (treshold <= 5.0f || treshold >= 95.0f) {
-        std::cerr << "error: invalid treshold argument: " << treshold << std::endl;
-        std::cout << desc << std::endl;
+    BatteryWatch::PolicyEngine policy;
+
+    auto use_policy = use_config;
+
+    if (use_config) {
+        try {
+            policy.read(vm["config"].as<std::string>());
+        } catch (const std::exception &err) {
+            // Never run without low battery protection, e.g. if the config wasn't installed.
+            if (!use_treshold) {
+                std::cerr << "error: failed to read policy config: " << err.what() << std::endl;
+
+                return 3;
+            }
 
-        return 4;
+            std::cerr << "warn: failed to read policy config, using treshold: " << err.what() << std::endl;
+
+            use_policy = false;
+        }
     }
 
-    BatteryWatch::BatteryContext battery_ctx(vm["device"].as<std::string>());
+    if (!use_policy) {
+        policy.fromTreshold(vm["treshold"].as<float>());
+    }
 
-    const std::chrono::seconds polling_interval{vm["interval"].as<unsigned>()};
+    std::vector<std::string> devices;
 
-    while (true) {
+    if (vm.count("device") != 0) {
+        devices = vm["device"].as<std::vector<std::string>>();
+    }
+
+    BatteryWatch::BatteryContext battery_ctx(devices);
+
+    std::optional<std::filesystem::path> history_path;
+
+    if (vm.count("history-file") != 0) {
+        history_path = vm["history-file"].as<std::string>();
+
+        std::signal(SIGUSR1, [](int) { BatteryWatch::dump_requested = 1; });
+    }
+
+    const auto evaluate = [&]() {
         battery_ctx.poll();
+        policy.evaluate(battery_ctx);
+
+        if (BatteryWatch::dump_requested != 0 && history_path.has_value()) {
+            BatteryWatch::dump_requested = 0;
+
+            try {
+                battery_ctx.dump_history(history_path.value());
+            } catch (const std::exception &err) {
+                std::cerr << "warn: failed to dump history: " << err.what() << std::endl;
+            }
+        }
+    };
+
+    if (event_mode) {
+        const std::chrono::seconds fallback_interval{
+            vm.count("fallback") != 0 ? vm["fallback"].as<unsigned>() : BatteryWatch::kFallbackInterval};
 
-        if (battery_ctx.is_critical(treshold)) {
-            std::cout << "info: battery level critical, suspending system..." << std::endl;
+        if (fallback_interval.count() == 0) {
+            std::cerr << "error: invalid fallback argument: " << fallback_interval.count() << std::endl;
+            std::cout << desc << std::endl;
 
-            BatteryWatch::sys_suspend();
+            return 6;
         }
 
-        std::this_thread::sleep_for(polling_interval);
+        BatteryWatch::MonitorContext monitor_ctx;
+
+        // Subscribe before the first poll, so that no change is lost in between.
+        monitor_ctx.init();
+
+        const std::chrono::seconds min_interval{BatteryWatch::kMinInterval};
+
+        while (true) {
+            evaluate();
+
+            // Without uevents for charge changes, the projected crossing still bounds the wait.
+            const auto interval = policy.nextInterval(battery_ctx, std::min(min_interval, fallback_interval), fallback_interval, true);
+
+            if (monitor_ctx.wait(interval, {policy.wakeFD(), policy.replyFD()})) {
+                battery_ctx.refresh();
+            }
+        }
+    }
+
+    if (adaptive) {
+        const std::chrono::seconds min_interval{BatteryWatch::kMinInterval};
+        const std::chrono::seconds max_interval{
+            vm.count("max-interval") != 0 ? vm["max-interval"].as<unsigned>() : BatteryWatch::kMaxInterval};
+
+        if (max_interval < min_interval) {
+            std::cerr << "error: invalid max-interval argument: " << max_interval.count() << std::endl;
+            std::cout << desc << std::endl;
+
+            return 5;
+        }
+
+        while (true) {
+            evaluate();
+
+            BatteryWatch::wait_readable({policy.wakeFD(), policy.replyFD()}, policy.nextInterval(battery_ctx, min_interval, max_interval, false));
+        }
+    }
+
+    const std::chrono::seconds polling_interval{vm["interval"].as<unsigned>()};
+
+    while (true) {
+        evaluate();
+
+        BatteryWatch::wait_readable({policy.wakeFD(), policy.replyFD()}, polling_interval);
     }
 
     return 0;
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "brightness_utils/protocol.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+namespace detail {
+
+    static constexpr unsigned kDefaultIterations{5000000};
+    static constexpr unsigned kMockBacklights{2};
+    static constexpr std::uint32_t kMockMaxBrightness{255};
+
+} // namespace detail
+
+namespace ProtocolBench {
+
+    using namespace BrightnessDaemon;
+
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Stand-in for BacklightContext that only does the staging arithmetic.
+     */
+    struct MockBacklight {
+        std::uint32_t staged{0};
+        std::uint32_t saved{0};
+
+        void setState(std::uint32_t value) {
+            staged = std::min(value, ::detail::kMockMaxBrightness);
+        }
+
+        void modifyState(std::int32_t delta) {
+            const auto value = static_cast<std::int64_t>(staged) + delta;
+
+            staged = static_cast<std::uint32_t>(std::clamp<std::int64_t>(value, 0, ::detail::kMockMaxBrightness));
+        }
+
+        void stepState(int direction) {
+            modifyState(direction * 16);
+        }
+    };
+
+    /**
+     * Handler with the same target selection logic as the socket context, but without any I/O.
+     */
+    struct MockHandler {
+        std::array<MockBacklight, ::detail::kMockBacklights> backlights{};
+
+        std::uint8_t  target_mask{0x01};
+        std::uint64_t replies{0};
+
+        template<typename Function>
+        void forEachTarget(Function &&func) {
+            for (unsigned i = 0; i < backlights.size(); ++i) {
+                if (target_mask & (1u << i)) {
+                    func(backlights[i]);
+                }
+            }
+        }
+
+        void onCommand(CommandType) {}
+
+        void onSetState(std::uint32_t value) {
+            forEachTarget([value](auto &bl) { bl.setState(value); });
+        }
+
+        void onModifyState(std::int32_t value) {
+            forEachTarget([value](auto &bl) { bl.modifyState(value); });
+        }
+
+        void onSaveState() {
+            forEachTarget([](auto &bl) { bl.saved = bl.staged; });
+        }
+
+        void onRestoreState() {
+            forEachTarget([](auto &bl) { bl.staged = bl.saved; });
+        }
+
+        void onSetPowersave() {
+            forEachTarget([](auto &bl) { bl.staged = 0; });
+        }
+
+        void onSelectTarget(std::uint8_t mask) {
+            target_mask = mask;
+        }
+
+        void onGetStats() {
+            ++replies;
+        }
+
+        void onStep(int direction) {
+            forEachTarget([direction](auto &bl) { bl.stepState(direction); });
+        }
+
+        void onGetState() {
+            ++replies;
+        }
+
+        void onSubscribe() {}
+        void onUnsubscribe() {}
+    };
+
+    using Datagram = std::vector<std::uint8_t>;
+
+    static void append_frame(Datagram &data, CommandType type, const void *payload, std::uint8_t len) {
+        data.push_back(static_cast<std::uint8_t>(type));
+        data.push_back(len);
+
+        const auto bytes = static_cast<const std::uint8_t *>(payload);
+
+        data.insert(data.end(), bytes, bytes + len);
+    }
+
+    /**
+     * Build a representative mix of datagrams, including a batch that addresses both backlights.
+     */
+    static auto make_datagrams() {
+        std::vector<Datagram> datagrams;
+
+        const std::uint32_t set_value{128};
+        const std::int32_t  modify_value{-8};
+        const std::uint8_t  mask{0x03};
+
+        {
+            Datagram data;
+            append_frame(data, CommandType::SetState, &set_value, sizeof(set_value));
+            datagrams.push_back(std::move(data));
+        }
+
+        {
+            Datagram data;
+            append_frame(data, CommandType::ModifyState, &modify_value, sizeof(modify_value));
+            datagrams.push_back(std::move(data));
+        }
+
+        {
+            Datagram data;
+            append_frame(data, CommandType::StepUp, nullptr, 0);
+            datagrams.push_back(std::move(data));
+        }
+
+        {
+            Datagram data;
+            append_frame(data, CommandType::GetState, nullptr, 0);
+            datagrams.push_back(std::move(data));
+        }
+
+        {
+            Datagram payload;
+            append_frame(payload, CommandType::SelectTarget, &mask, sizeof(mask));
+            append_frame(payload, CommandType::SetState, &set_value, sizeof(set_value));
+            append_frame(payload, CommandType::StepDown, nullptr, 0);
+            append_frame(payload, CommandType::SaveState, nullptr, 0);
+
+            Datagram data{
+                static_cast<std::uint8_t>(CommandType::Batch),
+                static_cast<std::uint8_t>(::detail::kBatchFrameSizeMin + payload.size()),
+                ::detail::kBatchVersion,
+                4,
+            };
+
+            data.insert(data.end(), payload.cbegin(), payload.cend());
+            datagrams.push_back(std::move(data));
+        }
+
+        return datagrams;
+    }
+
+    static auto run(const std::vector<Datagram> &datagrams, unsigned iterations, MockHandler &handler) {
+        unsigned failed{0};
+
+        const auto start = clock::now();
+
+        for (unsigned i = 0; i < iterations; ++i) {
+            const auto &data = datagrams[i % datagrams.size()];
+
+            handler.target_mask = 0x01;
+
+            if (parse_datagram(std::span{data.data(), data.size()}, handler) != ParseStatus::Ok) {
+                ++failed;
+            }
+        }
+
+        const auto elapsed = clock::now() - start;
+
+        if (failed != 0) {
+            throw std::runtime_error{"unexpected parse failure"};
+        }
+
+        return elapsed;
+    }
+
+} // namespace ProtocolBench
+
+/**
+ * Usage: bench_protocol [iterations]
+ *
+ * Pushes synthetic datagrams through the protocol parser and a mock backlight
+ * handler, so that parsing and dispatch are measured without sysfs or socket I/O.
+ */
+int main(int argc, char *argv[]) {
+    using namespace ProtocolBench;
+
+    const unsigned iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : ::detail::kDefaultIterations;
+    if (iterations == 0) {
+        std::cerr << "error: invalid iteration count" << std::endl;
+
+        return 1;
+    }
+
+    const auto datagrams = make_datagrams();
+
+    MockHandler handler;
+
+    const auto elapsed  = run(datagrams, iterations, handler);
+    const auto total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+    std::cout << "parse+dispatch: " << (total_ns / iterations) << " ns/datagram (" << iterations << " datagrams, "
+              << (iterations * 1000000000.0 / total_ns) << " datagrams/s)" << std::endl;
+
+    // Keep the mock state observable, so that the work isn't optimized away.
+    std::cout << "checksum: " << (handler.backlights[0].staged + handler.backlights[1].staged + handler.replies) << std::endl;
+
+    return 0;
+}
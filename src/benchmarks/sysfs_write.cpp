@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "brightness_utils/sysfs_attribute.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace detail {
+
+    static constexpr unsigned kDefaultIterations{200000};
+    static constexpr unsigned kValueRange{256};
+
+} // namespace detail
+
+namespace SysfsWriteBench {
+
+    namespace fs = std::filesystem;
+
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Previous write path of BacklightContext::set(), i.e. formatting with
+     * std::to_string() and pushing the value through a std::fstream.
+     */
+    static auto run_fstream(const fs::path &path, unsigned iterations) {
+        std::fstream stream;
+
+        stream.exceptions(std::fstream::failbit | std::fstream::badbit);
+        stream.open(path, std::fstream::in | std::fstream::out);
+
+        const auto start = clock::now();
+
+        for (unsigned i = 0; i < iterations; ++i) {
+            stream << std::to_string(i % ::detail::kValueRange);
+            stream.flush();
+        }
+
+        return clock::now() - start;
+    }
+
+    /**
+     * Current write path, i.e. std::to_chars() into a stack buffer and a single pwrite().
+     */
+    static auto run_pwrite(const fs::path &path, unsigned iterations) {
+        BrightnessDaemon::SysfsAttribute attr;
+
+        attr.open(path);
+
+        const auto start = clock::now();
+
+        for (unsigned i = 0; i < iterations; ++i) {
+            attr.write(i % ::detail::kValueRange);
+        }
+
+        return clock::now() - start;
+    }
+
+    static void report(const char *name, clock::duration elapsed, unsigned iterations) {
+        const auto total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+        std::cout << name << ": " << (total_ns / iterations) << " ns/call (" << iterations << " calls)" << std::endl;
+    }
+
+} // namespace SysfsWriteBench
+
+/**
+ * Usage: bench_sysfs_write [path] [iterations]
+ *
+ * Without a path a temporary regular file is used, which measures the userspace
+ * overhead only. Pass a real backlight brightness node to include the driver cost.
+ */
+int main(int argc, char *argv[]) {
+    using namespace SysfsWriteBench;
+
+    fs::path path;
+    bool     is_temporary{false};
+
+    if (argc > 1) {
+        path = argv[1];
+    } else {
+        path = fs::temp_directory_path() / "bench_sysfs_write.tmp";
+        is_temporary = true;
+
+        std::ofstream touch(path);
+    }
+
+    const unsigned iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : ::detail::kDefaultIterations;
+    if (iterations == 0) {
+        std::cerr << "error: invalid iteration count" << std::endl;
+
+        return 1;
+    }
+
+    report("fstream", run_fstream(path, iterations), iterations);
+    report("pwrite", run_pwrite(path, iterations), iterations);
+
+    if (is_temporary) {
+        fs::remove(path);
+    }
+
+    return 0;
+}
@@ -1,385 +1,1254 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "brightness_utils/config.h"
+#include "brightness_utils/iio.h"
+#include "brightness_utils/protocol.h"
+#include "brightness_utils/state.h"
+#include "brightness_utils/state_page.h"
+#include "brightness_utils/stats.h"
 #include "brightness_utils/sysfs.h"
+#include "brightness_utils/sysfs_attribute.h"
 
 #include <boost/asio/local/datagram_protocol.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <libudev.h>
+#include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string_view>
 #include <vector>
 
-#include <ext/stdio_filebuf.h>
+namespace detail {
+
+    using namespace std::string_view_literals;
+
+    static constexpr unsigned kSubscribersMax{16};
+
+    // Selects the first (primary) backlight, which is the target unless a datagram says otherwise.
+    static constexpr std::uint8_t kDefaultTargetMask{0x01};
+
+    // Upper bound for datagrams handled in one drain pass, so that a flooding client can't starve the loop.
+    static constexpr unsigned kDrainFramesMax{256};
+
+    // Lower bound for the interval between two transition steps.
+    static constexpr std::chrono::milliseconds kTransitionStepMin{8};
+
+    // A transition step interval is at least this multiple of the measured sysfs write cost.
+    static constexpr unsigned kTransitionCostFactor{4};
+
+    // Maximum number of ambient light samples handled per read.
+    static constexpr unsigned kAmbientSamplesMax{16};
+
+} // namespace detail
+
+namespace BrightnessDaemon {
+
+    namespace as = boost::asio;
+    namespace fs = std::filesystem;
+
+    using proto = as::local::datagram_protocol;
+
+    struct BacklightState {
+        std::uint32_t sequence;
+        std::uint32_t current;
+        std::uint32_t max;
+        std::uint32_t saved;
+    };
+
+    class BacklightContext {
+    private:
+        using clock = std::chrono::steady_clock;
+
+    public:
+        BacklightContext(as::io_context &ioc, const Config &cfg, const BacklightIdentifier &identifier, StateStore &store, Stats &stats) :
+            cfg_(cfg), identifier_(identifier), store_(store), stats_(stats), transition_timer_(ioc) {}
+    
+        void init() {
+            bind();
+
+            target_brightness_ = current_brightness_;
+
+            publish();
+        }
+
+        /**
+         * @brief Publish the state of this backlight in a shared state page.
+         *
+         * @param page  The state page
+         * @param index Index of the backlight in the page
+         */
+        void setStatePage(StatePageWriter &page, unsigned index) {
+            state_page_       = &page;
+            state_page_index_ = index;
+        }
+
+        /**
+         * @brief Re-resolve the backlight node after a hotplug event.
+         *
+         * If the node is found again, the last known brightness is replayed. If
+         * it is gone, the context stays unbound and keeps the target brightness
+         * until the node reappears.
+         *
+         * This runs without root privileges, so the brightness attribute has to
+         * be group-writable (see 72-backlight-brightness.rules).
+         */
+        void rebind() {
+            transition_timer_.cancel();
+            transition_active_ = false;
+
+            brightness_attr_.close();
+
+            try {
+                bind();
+            } catch (const std::runtime_error &err) {
+                ::sd_journal_print(LOG_NOTICE, "backlight %s unbound: %s", identifier_.prefix.data(), err.what());
+
+                return;
+            }
+
+            ::sd_journal_print(LOG_NOTICE, "backlight %s rebound", identifier_.prefix.data());
+
+            stage(std::min(target_brightness_, max_brightness_));
+            commit();
+        }
+
+        /**
+         * @brief Set the backlight brightness state.
+         *
+         * @param value The (unsigned) integer value to apply
+         *
+         * No clamping is done, and the method throws when the value is invalid.
+         * The value is only staged, call commit() to write it to the backlight.
+         */
+        void setState(const unsigned value) {
+            if (value > max_brightness_) {
+                throw std::runtime_error{"value too large"};
+            }
+
+            stage(value);
+            biasAmbient();
+        }
+
+        /**
+         * @brief Modify the backlight brightness state.
+         *
+         * @param value The (signed) integer value to apply
+         *
+         * Modify applies the signed integer value to the staged brightness value,
+         * so that several modifications before a commit accumulate.
+         * The final value is clamped.
+         */
+        void modifyState(const int value) {
+            auto tmp = static_cast<int>(target_brightness_) + value;
+            if (tmp < 0) {
+                tmp = 0;
+            }
+
+            if (tmp > static_cast<int>(max_brightness_)) {
+                tmp = max_brightness_;
+            }
+
+            stage(static_cast<unsigned>(tmp));
+            biasAmbient();
+        }
+
+        /**
+         * @brief Move the backlight brightness by perceptual steps.
+         *
+         * @param steps Number of steps (negative values step down)
+         *
+         * The steps come from the lookup table built for the maximum brightness
+         * of the panel. A staged value between two table entries counts as being
+         * one step below the upper entry and one step above the lower one.
+         */
+        void stepState(const int steps) {
+            if (step_table_.empty()) {
+                throw std::runtime_error{"no step table"};
+            }
+
+            const auto last = static_cast<int>(step_table_.size()) - 1;
+
+            // Index of the largest entry that is not above the staged value.
+            const auto it = std::upper_bound(step_table_.cbegin(), step_table_.cend(), target_brightness_);
+            auto index = static_cast<int>(std::distance(step_table_.cbegin(), it)) - 1;
+
+            if (steps < 0 && step_table_[index] != target_brightness_) {
+                ++index;
+            }
+
+            stage(step_table_[std::clamp(index + steps, 0, last)]);
+            biasAmbient();
+        }
+
+        /**
+         * @brief Update the ambient illuminance (auto-brightness mode).
+         *
+         * @param lux Filtered illuminance
+         *
+         * Maps the illuminance through the configured curve and commits the
+         * result if it differs from the current target by more than the
+         * hysteresis. A recent manual change biases the curve.
+         */
+        void updateAmbient(double lux) {
+            const auto &ambient = cfg_.ambient;
+
+            ambient_active_ = true;
+
+            if (ambient_bias_ != 0 && clock::now() >= ambient_bias_expiry_) {
+                ambient_bias_ = 0;
+            }
+
+            const auto max_value = static_cast<double>(max_brightness_);
+
+            ambient_value_ = static_cast<int>(std::lround(ambient.curve.evaluate(lux) * max_value / 100.0));
+
+            const auto value = std::clamp(ambient_value_ + ambient_bias_, 0, static_cast<int>(max_brightness_));
+            const auto delta = std::abs(value - static_cast<int>(target_brightness_));
+
+            if (static_cast<double>(delta) < ambient.hysteresis * max_value / 100.0) {
+                return;
+            }
+
+            stage(static_cast<unsigned>(value));
+            commit();
+        }
+
+        /**
+         * @brief Save the backlight brightness to the state storage file.
+         */
+        void saveState() {
+            store_.put(identifier_, StateSlot::Saved, target_brightness_);
+            store_.flush();
+
+            saved_brightness_ = target_brightness_;
+
+            publish();
+        }
+
+        /**
+         * @brief Restore the backlight brightness from the state storage file.
+         *
+         * The saved value is consumed, i.e. it is only restored once.
+         */
+        void restoreState() {
+            const auto tmp = store_.get(identifier_, StateSlot::Saved);
+            if (!tmp.has_value()) {
+                return;
+            }
+
+            // Just ignore a bogus value for now.
+            if (tmp.value() <= max_brightness_) {
+                saved_brightness_ = tmp.value();
+
+                stage(tmp.value());
+                publish();
+            }
+
+            // Staged first, so that a failed write doesn't lose the value.
+            store_.erase(identifier_, StateSlot::Saved);
+            store_.flush();
+        }
+
+        /**
+         * @brief Store the brightness that is applied when the daemon starts again.
+         *
+         * This is separate from the slot of saveState(), so exiting doesn't
+         * overwrite a value that a client saved.
+         */
+        void persistState() {
+            store_.put(identifier_, StateSlot::Persisted, target_brightness_);
+            store_.flush();
+        }
+
+        /**
+         * @brief Stage the brightness from the last run of the daemon.
+         */
+        void restorePersistedState() {
+            const auto tmp = store_.get(identifier_, StateSlot::Persisted);
+
+            if (tmp.has_value() && tmp.value() <= max_brightness_) {
+                stage(tmp.value());
+            }
+        }
+
+        /**
+         * @brief Set backlight brightness to the powersave state.
+         */
+        void setPowersave() {
+            setState(cfg_.powersave_value);
+        }
+
+        /**
+         * @brief Write the staged brightness value to the backlight.
+         *
+         * Does nothing if no value is pending. If transitions are enabled, this
+         * starts a transition towards the staged value instead. Committing while
+         * a transition is running retargets it, continuing from the current value
+         * and keeping the original end time.
+         */
+        void commit() {
+            if (!dirty_) {
+                return;
+            }
+
+            dirty_ = false;
+
+            // The target is replayed by rebind(), so nothing stays pending while unbound.
+            if (!brightness_attr_.is_open()) {
+                return;
+            }
+
+            if (cfg_.transition.duration.count() == 0) {
+                set(target_brightness_);
+                return;
+            }
+
+            const auto now = clock::now();
+
+            transition_from_  = current_brightness_;
+            transition_start_ = now;
+
+            if (!transition_active_) {
+                transition_end_    = now + cfg_.transition.duration;
+                transition_active_ = true;
+
+                transitionStep();
+            }
+        }
+
+        bool isPending() const {
+            return dirty_;
+        }
+
+        /**
+         * @brief Set a handler that is called after each write to the backlight.
+         */
+        void setChangeHandler(std::function<void()> handler) {
+            change_handler_ = std::move(handler);
+        }
+
+        /**
+         * @brief Get the cached backlight state.
+         *
+         * This doesn't touch sysfs.
+         */
+        BacklightState getState() const {
+            return BacklightState{
+                .sequence = sequence_,
+                .current  = current_brightness_,
+                .max      = max_brightness_,
+                .saved    = saved_brightness_,
+            };
+        }
+
+    private:
+        void publish() {
+            if (state_page_ != nullptr) {
+                state_page_->update(state_page_index_, current_brightness_, max_brightness_, saved_brightness_);
+            }
+        }
+
+        void bind() {
+            auto bl_node = lookup_backlight_node(identifier_);
+            if (!bl_node.has_value()) {
+                throw std::runtime_error{"failed to lookup backlight node"};
+            }
+
+            auto tmp = read_sysfs(bl_node.value() / "max_brightness"sv);
+            if (!tmp.has_value()) {
+                throw std::runtime_error{"failed to query maximum brightness"};
+            }
+
+            max_brightness_ = std::stoi(tmp.value());
+
+            step_table_ = cfg_.steps.curve.buildSteps(cfg_.steps.count, max_brightness_);
+
+            brightness_attr_.open(bl_node.value() / "brightness"sv);
+
+            sync();
+        }
+
+        void stage(const unsigned value) {
+            target_brightness_ = value;
+            dirty_ = true;
+        }
+
+        /**
+         * Turn a manual change into a temporary bias of the ambient curve, so
+         * that the next sample doesn't revert it.
+         */
+        void biasAmbient() {
+            if (!ambient_active_) {
+                return;
+            }
+
+            ambient_bias_        = static_cast<int>(target_brightness_) - ambient_value_;
+            ambient_bias_expiry_ = clock::now() + cfg_.ambient.bias_timeout;
+        }
+
+        void sync() {
+            current_brightness_ = brightness_attr_.read();
+        }
+
+        void set(const unsigned value) {
+            if (value > max_brightness_) {
+                throw std::runtime_error{"value too large"};
+            }
+
+            const auto start = clock::now();
+
+            brightness_attr_.write(value);
+
+            const auto write_cost = clock::now() - start;
+
+            current_brightness_ = value;
+            ++sequence_;
+
+            stats_.sysfs_write.record(write_cost);
+            ++stats_.writes;
+
+            publish();
+
+            // Exponential moving average of the write cost, used to pace transitions.
+            write_cost_ = (write_cost_ * 7 + write_cost) / 8;
+
+            if (change_handler_) {
+                change_handler_();
+            }
+        }
+
+        /**
+         * Interval between two transition steps.
+         *
+         * Slow backlight nodes (e.g. i2c or DPCD backed ones) get fewer and larger
+         * steps, instead of a backlog of writes.
+         */
+        clock::duration transitionInterval() const {
+            using namespace ::detail;
+
+            return std::max<clock::duration>(kTransitionStepMin, write_cost_ * kTransitionCostFactor);
+        }
+
+        void transitionStep() {
+            const auto &transition = cfg_.transition;
+
+            const auto now = clock::now();
+
+            const auto done = now >= transition_end_;
+
+            const auto elapsed = std::chrono::duration<double>(now - transition_start_);
+            const auto t = done ? 1.0 : elapsed / std::chrono::duration<double>(transition_end_ - transition_start_);
+
+            const auto value = done ? target_brightness_ :
+                transition.curve.interpolate(transition_from_, target_brightness_, t, max_brightness_);
+
+            try {
+                if (value != current_brightness_) {
+                    set(value);
+                }
+            } catch (const std::runtime_error &err) {
+                ::sd_journal_print(LOG_ERR, "error during transition: %s", err.what());
+
+                transition_active_ = false;
+                return;
+            }
+
+            if (done) {
+                transition_active_ = false;
+                return;
+            }
+
+            transition_timer_.expires_after(transitionInterval());
+            transition_timer_.async_wait([this](const auto &ec) {
+                // Cancelled by rebind(), which already reset the state and might have started a new ramp.
+                if (ec == as::error::operation_aborted) {
+                    return;
+                }
+
+                if (!ec) {
+                    transitionStep();
+                } else {
+                    transition_active_ = false;
+                }
+            });
+        }
+
+    private:
+        const Config &cfg_;
+
+        const BacklightIdentifier &identifier_;
+        StateStore                &store_;
+        Stats                     &stats_;
+
+        unsigned current_brightness_;
+        unsigned target_brightness_;
+        unsigned max_brightness_;
+        unsigned saved_brightness_{::detail::kInvalidValue};
+
+        std::uint32_t sequence_{0};
+
+        std::function<void()> change_handler_;
+
+        StatePageWriter *state_page_{nullptr};
+        unsigned         state_page_index_{0};
+
+        bool dirty_{false};
+
+        std::vector<unsigned> step_table_;
+
+        as::steady_timer  transition_timer_;
+        clock::time_point transition_start_{};
+        clock::time_point transition_end_{};
+        unsigned          transition_from_{0};
+        bool              transition_active_{false};
+
+        clock::duration write_cost_{0};
+
+        bool              ambient_active_{false};
+        int               ambient_value_{0};
+        int               ambient_bias_{0};
+        clock::time_point ambient_bias_expiry_{};
+
+        SysfsAttribute brightness_attr_;
+    };
+
+    using BacklightContexts = std::vector<std::unique_ptr<BacklightContext>>;
+
+    /**
+     * Watches the backlight subsystem for hotplug events.
+     *
+     * The udev monitor is driven by the event loop, and every add/remove of a
+     * backlight device makes all backlight contexts re-resolve their node.
+     */
+    class HotplugContext {
+    public:
+        HotplugContext(as::io_context &ioc) : stream_(ioc) {}
+
+        ~HotplugContext() {
+            // The descriptor is owned by the udev monitor.
+            if (stream_.is_open()) {
+                stream_.release();
+            }
+
+            if (monitor_ != nullptr) {
+                ::udev_monitor_unref(monitor_);
+            }
+
+            if (udev_ctx_ != nullptr) {
+                ::udev_unref(udev_ctx_);
+            }
+        }
+
+        void init() {
+            udev_ctx_ = ::udev_new();
+            if (udev_ctx_ == nullptr) {
+                throw std::runtime_error{"failed to create udev context"};
+            }
+
+            monitor_ = ::udev_monitor_new_from_netlink(udev_ctx_, "udev");
+            if (monitor_ == nullptr) {
+                throw std::runtime_error{"failed to create udev monitor"};
+            }
+
+            if (::udev_monitor_filter_add_match_subsystem_devtype(monitor_, "backlight", nullptr) < 0) {
+                throw std::runtime_error{"failed to add udev monitor filter"};
+            }
+
+            if (::udev_monitor_enable_receiving(monitor_) < 0) {
+                throw std::runtime_error{"failed to enable udev monitor"};
+            }
+
+            stream_.assign(::udev_monitor_get_fd(monitor_));
+        }
+
+        void start(BacklightContexts &bl_ctxs) {
+            bl_ctxs_ = &bl_ctxs;
+
+            process();
+        }
+
+    private:
+        void handleEvents() {
+            bool rebind{false};
+
+            while (true) {
+                auto device = ::udev_monitor_receive_device(monitor_);
+                if (device == nullptr) {
+                    break;
+                }
+
+                const auto action = ::udev_device_get_action(device);
+
+                if (action != nullptr && (action == "add"sv || action == "remove"sv)) {
+                    ::sd_journal_print(LOG_NOTICE, "backlight hotplug: %s %s", action, ::udev_device_get_sysname(device));
+
+                    rebind = true;
+                }
+
+                ::udev_device_unref(device);
+            }
+
+            if (rebind) {
+                for (auto &bl_ctx : *bl_ctxs_) {
+                    bl_ctx->rebind();
+                }
+            }
+        }
+
+        void process() {
+            stream_.async_wait(as::posix::stream_descriptor::wait_read, [this](const auto &ec) {
+                if (!ec) {
+                    handleEvents();
+
+                    process();
+                }
+            });
+        }
+
+    private:
+        struct ::udev         *udev_ctx_{nullptr};
+        struct ::udev_monitor *monitor_{nullptr};
+
+        as::posix::stream_descriptor stream_;
+
+        BacklightContexts *bl_ctxs_{nullptr};
+    };
+
+    /**
+     * Feeds an ambient light sensor into a backlight context.
+     *
+     * Samples are read from the IIO character device by the event loop and
+     * smoothed with an exponential moving average.
+     */
+    class AmbientContext {
+    public:
+        AmbientContext(as::io_context &ioc, const Config &cfg) : cfg_(cfg), stream_(ioc) {}
+
+        ~AmbientContext() {
+            // The descriptor is owned by the IIO channel.
+            if (stream_.is_open()) {
+                stream_.release();
+            }
+        }
+
+        void init() {
+            using namespace ::detail;
+
+            channel_.init(cfg_.ambient.device_name, cfg_.ambient.channel);
+
+            buffer_.resize(channel_.sampleSize() * kAmbientSamplesMax);
+
+            stream_.assign(channel_.fd());
+        }
+
+        void start(BacklightContext &bl_ctx) {
+            bl_ctx_ = &bl_ctx;
+
+            process();
+        }
+
+    private:
+        void handleSamples(std::size_t bytes_transferred) {
+            const auto sample_size = channel_.sampleSize();
+
+            if (bytes_transferred < sample_size) {
+                return;
+            }
+
+            for (std::size_t offset = 0; offset + sample_size <= bytes_transferred; offset += sample_size) {
+                const auto lux = std::max(channel_.decode(buffer_.data() + offset), 0.0);
+
+                if (filtered_lux_ < 0.0) {
+                    filtered_lux_ = lux;
+                } else {
+                    filtered_lux_ += cfg_.ambient.filter * (lux - filtered_lux_);
+                }
+            }
+
+            try {
+                bl_ctx_->updateAmbient(filtered_lux_);
+            } catch (const std::runtime_error &err) {
+                ::sd_journal_print(LOG_ERR, "error applying ambient brightness: %s", err.what());
+            }
+        }
+
+        void process() {
+            stream_.async_read_some(as::buffer(buffer_), [this](const auto &ec, auto bytes_transferred) {
+                if (ec) {
+                    ::sd_journal_print(LOG_ERR, "failed to read ambient light sensor: %s", ec.message().data());
+                    return;
+                }
+
+                handleSamples(bytes_transferred);
+
+                process();
+            });
+        }
+
+    private:
+        const Config &cfg_;
+
+        IIOBufferedChannel           channel_;
+        as::posix::stream_descriptor stream_;
+
+        BacklightContext *bl_ctx_{nullptr};
+
+        double filtered_lux_{-1.0};
+
+        std::vector<std::uint8_t> buffer_;
+    };
+
+    class SocketContext {
+    public:
+        SocketContext(as::io_context &ioc, const Config &cfg, Stats &stats) :
+            ioc_(ioc), cfg_(cfg), stats_(stats), sock_(ioc), ep_(cfg.socket_path), commit_timer_(ioc), idle_timer_(ioc) {}
+
+        ~SocketContext() {
+            // An activated socket is owned by systemd.
+            if (activated_) {
+                return;
+            }
+
+            std::error_code ec;
+
+            fs::remove(cfg_.socket_path, ec);
+        }
+
+        void init() {
+            if (adoptActivatedSocket()) {
+                return;
+            }
+
+            fs::remove(cfg_.socket_path);
+
+            sock_.open();
+            sock_.bind(ep_);
+
+            // Only affects the synchronous receives used when draining, async operations are unchanged.
+            sock_.non_blocking(true);
+
+            if (!cfg_.user.empty()) {
+                using fs::perms;
+
+                const auto info = get_uid_gid(cfg_.user.data(), cfg_.group.data());
+
+                fs::permissions(cfg_.socket_path, perms::owner_all | perms::group_all);
+
+                const auto ret = ::chown(cfg_.socket_path.string().data(), info.first, info.second);
+                if (ret != 0) {
+                    throw std::runtime_error{std::string{"fchown() failed: "} + std::strerror(errno)};
+                }
+            }
+        }
+
+        /**
+         * Was the socket passed in by systemd socket activation?
+         */
+        bool isActivated() const {
+            return activated_;
+        }
+
+        /**
+         * Defer the backlight setup until the first frame arrives.
+         *
+         * @param handler Handler that populates the backlight contexts
+         *
+         * Root privileges are kept until the handler has run.
+         */
+        void setLazyInit(std::function<void()> handler) {
+            lazy_init_ = std::move(handler);
+        }
+
+        /**
+         * Set a handler that is called when the daemon was idle for the configured time.
+         *
+         * Only used with socket activation, since otherwise nothing would restart the daemon.
+         */
+        void setIdleHandler(std::function<void()> handler) {
+            idle_handler_ = std::move(handler);
+        }
+
+        void start(BacklightContexts &bl_ctxs, bool verbose) {
+            bl_ctxs_ = &bl_ctxs;
+            verbose_ = verbose;
 
-namespace detail {
+            if (!lazy_init_) {
+                setupBacklights();
+            }
 
-    using namespace std::string_view_literals;
+            armIdleTimer();
 
-    static constexpr unsigned kBufferSize{64};
+            process();
+        }
 
-    static constexpr unsigned kCommandFrameLenMax{32};
-    static constexpr unsigned kCommandFrameSizeMin{2};
+    private:
+        bool adoptActivatedSocket() {
+            const auto num_fds = ::sd_listen_fds(1);
+            if (num_fds <= 0) {
+                return false;
+            }
 
-    static constexpr std::array kCommandTypeStrings{
-        "SetState"sv,
-        "ModifyState"sv,
-        "SaveState"sv,
-        "RestoreState"sv,
-        "SetPowersave"sv,
-    };
+            if (num_fds != 1) {
+                throw std::runtime_error{"unexpected number of activated sockets"};
+            }
 
-    static bool running{false};
+            const auto fd = SD_LISTEN_FDS_START;
 
-} // namespace detail
+            if (::sd_is_socket_unix(fd, SOCK_DGRAM, -1, cfg_.socket_path.c_str(), 0) <= 0) {
+                throw std::runtime_error{"activated socket doesn't match configuration"};
+            }
 
-namespace BrightnessDaemon {
+            sock_.assign(proto(), fd);
+            sock_.non_blocking(true);
 
-    namespace as = boost::asio;
-    namespace fs = std::filesystem;
+            activated_ = true;
 
-    using proto = as::local::datagram_protocol;
+            return true;
+        }
 
-    enum class CommandType : std::uint8_t {
-        SetState,
-        ModifyState,
-        SaveState,
-        RestoreState,
-        SetPowersave,
+        void setupBacklights() {
+            if (lazy_init_) {
+                const auto handler = std::move(lazy_init_);
 
-        Count,
-    };
+                lazy_init_ = nullptr;
 
-    struct CommandFrame {
-        CommandType  type;
-        std::uint8_t len;
-        std::uint8_t value[];
-    };
+                handler();
+            }
+
+            drop_root_privileges(cfg_.user.data(), cfg_.group.data());
 
-    struct SetStateFrame {
-        CommandType   type;
-        std::uint8_t  len;
-        std::uint32_t value;
-    } __attribute__((packed));
-
-    struct ModifyStateFrame {
-        CommandType   type;
-        std::uint8_t  len;
-        std::int32_t value;
-    } __attribute__((packed));
-
-    static auto to_string(const CommandType& ct) {
-        switch (ct) {
-            case CommandType::SetState:
-            case CommandType::ModifyState:
-            case CommandType::SaveState:
-            case CommandType::RestoreState:
-            case CommandType::SetPowersave:
-                return ::detail::kCommandTypeStrings[static_cast<unsigned>(ct)];
-
-            default:
-                throw std::runtime_error{"invalid command type"};
+            for (unsigned i = 0; i < bl_ctxs_->size(); ++i) {
+                (*bl_ctxs_)[i]->setChangeHandler([this, i]() { scheduleNotify(i); });
+            }
         }
-    }
 
-    /**
-     * GCC-specific truncate implementation.
-     *
-     * TODO/LATER: Should be replaced with a toolchain-independant version, e.g.
-     * using boost::iostreams? Or look into std::filesystem::resize_file().
-     */
-    static void truncate(std::fstream &stream, const std::size_t length) {
-        using IOBufferType = __gnu_cxx::stdio_filebuf<char>;
+        void armIdleTimer() {
+            // Sensor samples are activity as well, so ambient mode never goes idle.
+            if (!activated_ || !idle_handler_ || cfg_.idle_timeout.count() == 0 || cfg_.ambient.enabled) {
+                return;
+            }
+
+            idle_timer_.expires_after(cfg_.idle_timeout);
+            idle_timer_.async_wait([this](const auto &ec) {
+                if (ec) {
+                    return;
+                }
+
+                // Don't exit with a change in flight, or while clients wait for notifications.
+                if (commit_deferred_ || isPending() || !subscribers_.empty()) {
+                    armIdleTimer();
+                    return;
+                }
 
-        auto iobuf = static_cast<IOBufferType *>(stream.rdbuf());
+                ::sd_journal_print(LOG_NOTICE, "exiting after idle timeout");
 
-        const auto ret = ::ftruncate(iobuf->fd(), static_cast<::off_t>(length));
-        if (ret != 0) {
-            throw std::runtime_error{std::string{"ftruncate() failed: "} + std::strerror(errno)};
+                idle_handler_();
+            });
         }
-    }
 
-    class BacklightContext {
-    public:
-        BacklightContext(const Config &cfg) : cfg_(cfg) {}
-    
-        void init() {
-            using std::fstream;
+        /**
+         * Adapter between the protocol parser and the socket context.
+         */
+        struct FrameHandler {
+            SocketContext &ctx;
 
-            auto bl_node = lookup_backlight_node(cfg_.identifier);
-            if (!bl_node.has_value()) {
-                throw std::runtime_error{"failed to lookup backlight node"};
+            void onCommand(CommandType type) {
+                if (ctx.verbose_) {
+                    // We need a null-terminated string for sd_journal.
+                    const std::string cmd_type{to_string(type)};
+
+                    ::sd_journal_print(LOG_NOTICE, "handling command type: %s", cmd_type.data());
+                }
             }
 
-            auto tmp = read_sysfs(bl_node.value() / "max_brightness"sv);
-            if (!tmp.has_value()) {
-                throw std::runtime_error{"failed to query maximum brightness"};
+            void onSetState(std::uint32_t value) {
+                ctx.forEachTarget([value](auto &bl_ctx) { bl_ctx.setState(value); });
             }
 
-            max_brightness_ = std::stoi(tmp.value());
+            void onModifyState(std::int32_t value) {
+                ctx.forEachTarget([value](auto &bl_ctx) { bl_ctx.modifyState(value); });
+            }
 
-            brightness_stream_.exceptions(fstream::failbit | fstream::badbit);
-            brightness_stream_.open(bl_node.value() / "brightness"sv);
+            void onSaveState() {
+                ctx.forEachTarget([](auto &bl_ctx) { bl_ctx.saveState(); });
+            }
 
-            sync();
+            void onRestoreState() {
+                ctx.forEachTarget([](auto &bl_ctx) { bl_ctx.restoreState(); });
+            }
 
-            if (!fs::exists(cfg_.state_path)) {
-                const auto parent = cfg_.state_path.parent_path();
-                if (!fs::is_directory(parent)) {
-                    fs::create_directories(parent);
-                }
+            void onSetPowersave() {
+                ctx.forEachTarget([](auto &bl_ctx) { bl_ctx.setPowersave(); });
+            }
 
-                std::ofstream ofs(cfg_.state_path);
+            void onSelectTarget(std::uint8_t mask) {
+                ctx.selectTarget(mask);
             }
 
-            storage_stream_.open(cfg_.state_path, fstream::in | fstream::out | fstream::binary);
-        }
+            void onGetStats() {
+                ctx.replyStats();
+            }
+
+            void onStep(int direction) {
+                ctx.forEachTarget([direction](auto &bl_ctx) { bl_ctx.stepState(direction); });
+            }
+
+            void onGetState() {
+                ctx.replyState();
+            }
+
+            void onSubscribe() {
+                ctx.subscribe();
+            }
+
+            void onUnsubscribe() {
+                std::erase(ctx.subscribers_, ctx.sender_);
+            }
+        };
 
         /**
-         * @brief Set the backlight brightness state.
-         *
-         * @param value The (unsigned) integer value to apply
+         * Send a reply to the sender of the current datagram.
          *
-         * No clamping is done, and the method throws when the value is invalid.
+         * The socket is non-blocking, so a client that doesn't read its replies
+         * can't stall the daemon. In that case the reply is dropped.
          */
-        void setState(const unsigned value) {
-            set(value);
+        template<typename ReplyType>
+        void reply(const ReplyType &frame) {
+            if (sender_.path().empty()) {
+                throw std::runtime_error{"reply to unbound sender"};
+            }
+
+            boost::system::error_code ec;
+
+            sock_.send_to(as::buffer(&frame, sizeof(frame)), sender_, 0, ec);
+            if (ec) {
+                ::sd_journal_print(LOG_WARNING, "failed to send reply: %s", ec.message().data());
+            }
         }
 
-        /**
-         * @brief Modify the backlight brightness state.
-         *
-         * @param value The (signed) integer value to apply
-         *
-         * Modify applies the signed integer value to the current brightness value.
-         * The final value is clamped.
-         */
-        void modifyState(const int value) {
-            auto tmp = static_cast<int>(current_brightness_) + value;
-            if (tmp < 0) {
-                tmp = 0;
+        void replyStats() {
+            StatsReplyFrame frame{
+                .type              = CommandType::GetStats,
+                .len               = sizeof(StatsReplyFrame) - ::detail::kCommandFrameSizeMin,
+                .frames_received   = stats_.frames_received,
+                .frames_malformed  = stats_.frames_malformed,
+                .frames_failed     = stats_.frames_failed,
+                .commits           = stats_.commits,
+                .writes            = stats_.writes,
+                .handle_frame      = {},
+                .sysfs_write       = {},
+                .receive_to_commit = {},
+            };
+
+            // Element-wise, since the frame members are unaligned.
+            for (unsigned i = 0; i < LatencyHistogram::kBuckets; ++i) {
+                frame.handle_frame[i]      = stats_.handle_frame.buckets[i];
+                frame.sysfs_write[i]       = stats_.sysfs_write.buckets[i];
+                frame.receive_to_commit[i] = stats_.receive_to_commit.buckets[i];
             }
 
-            if (tmp > static_cast<int>(max_brightness_)) {
-                tmp = max_brightness_;
+            reply(frame);
+        }
+
+        void selectTarget(std::uint8_t mask) {
+            const auto valid_mask = static_cast<std::uint8_t>((1u << bl_ctxs_->size()) - 1);
+
+            if ((mask & valid_mask) == 0) {
+                throw std::runtime_error{"invalid target selection"};
             }
 
-            set(static_cast<unsigned>(tmp));
+            target_mask_ = mask & valid_mask;
         }
 
         /**
-         * @brief Save the backlight brightness to the state storage file.
+         * Apply a function to all currently selected backlights.
          */
-        void saveState() {
-            storage_stream_.write(reinterpret_cast<const char *>(&current_brightness_), sizeof(unsigned));
-            storage_stream_.flush();
-
-            if (!storage_stream_.good()) {
-                throw std::runtime_error{"failed to save brightness state"};
+        template<typename Function>
+        void forEachTarget(Function &&func) {
+            for (unsigned i = 0; i < bl_ctxs_->size(); ++i) {
+                if (target_mask_ & (1u << i)) {
+                    func(*(*bl_ctxs_)[i]);
+                }
             }
-
-            storage_stream_.seekp(0);
         }
 
         /**
-         * @brief Restore the backlight brightness from the state storage file.
+         * Get the first selected backlight, used for queries.
          */
-        void restoreState() {
-            unsigned tmp;
+        BacklightContext &firstTarget() {
+            for (unsigned i = 0; i < bl_ctxs_->size(); ++i) {
+                if (target_mask_ & (1u << i)) {
+                    return *(*bl_ctxs_)[i];
+                }
+            }
+
+            throw std::runtime_error{"no target selected"};
+        }
 
-            storage_stream_.read(reinterpret_cast<char *>(&tmp), sizeof(tmp));
+        void replyState() {
+            const auto state = firstTarget().getState();
 
-            const auto good_read = storage_stream_.good();
+            const StateReplyFrame frame{
+                .type     = CommandType::GetState,
+                .len      = sizeof(StateReplyFrame) - ::detail::kCommandFrameSizeMin,
+                .sequence = state.sequence,
+                .current  = state.current,
+                .max      = state.max,
+                .saved    = state.saved,
+            };
 
-            storage_stream_.clear();
-            storage_stream_.seekg(0);
+            reply(frame);
+        }
 
-            truncate(storage_stream_, 0);
+        void subscribe() {
+            if (sender_.path().empty()) {
+                throw std::runtime_error{"subscribe from unbound sender"};
+            }
 
-            if (!good_read) {
+            if (std::find(subscribers_.cbegin(), subscribers_.cend(), sender_) != subscribers_.cend()) {
                 return;
             }
 
-            try {
-                set(tmp);
-            } catch ([[maybe_unused]] const std::runtime_error &err) {
-                // Just ignore this for now.
+            if (subscribers_.size() >= ::detail::kSubscribersMax) {
+                throw std::runtime_error{"too many subscribers"};
             }
+
+            subscribers_.push_back(sender_);
         }
 
         /**
-         * @brief Set backlight brightness to the powersave state.
+         * Schedule a change notification for all subscribers.
+         *
+         * @param index Index of the backlight that changed
+         *
+         * Notifications are coalesced, i.e. several changes during one event loop
+         * turn (e.g. a transition step and a commit) result in a single notification
+         * per backlight.
          */
-        void setPowersave() {
-            set(cfg_.powersave_value);
-        }
-
-    private:
-        void sync() {
-            std::string tmp;
+        void scheduleNotify(unsigned index) {
+            if (subscribers_.empty()) {
+                return;
+            }
 
-            brightness_stream_ >> tmp;
-            current_brightness_ = std::stoi(tmp);
+            const auto pending = notify_mask_ != 0;
 
-            brightness_stream_.clear();
-            brightness_stream_.seekg(0);
-        }
+            notify_mask_ |= 1u << index;
 
-        void set(const unsigned value) {
-            if (value > max_brightness_) {
-                throw std::runtime_error{"value too large"};
+            if (pending) {
+                return;
             }
 
-            brightness_stream_ << std::to_string(value);
-            current_brightness_ = value;
-            brightness_stream_.flush();
+            as::post(ioc_, [this]() {
+                const auto mask = notify_mask_;
+
+                notify_mask_ = 0;
+
+                for (unsigned i = 0; i < bl_ctxs_->size(); ++i) {
+                    if (mask & (1u << i)) {
+                        notifySubscribers(i);
+                    }
+                }
+            });
         }
 
-    private:
-        const Config &cfg_;
+        void notifySubscribers(unsigned index) {
+            const auto state = (*bl_ctxs_)[index]->getState();
 
-        unsigned current_brightness_;
-        unsigned max_brightness_;
+            const NotifyFrame frame{
+                .type     = CommandType::Subscribe,
+                .len      = sizeof(NotifyFrame) - ::detail::kCommandFrameSizeMin,
+                .target   = static_cast<std::uint8_t>(index),
+                .sequence = state.sequence,
+                .current  = state.current,
+            };
 
-        std::fstream brightness_stream_;
-        std::fstream storage_stream_;
-    };
+            std::erase_if(subscribers_, [this, &frame](const auto &subscriber) {
+                boost::system::error_code ec;
 
-    class SocketContext {
-    public:
-        SocketContext(as::io_context &ioc, const Config &cfg) : ioc_(ioc), cfg_(cfg), sock_(ioc), ep_(cfg.socket_path) {}
+                sock_.send_to(as::buffer(&frame, sizeof(frame)), subscriber, 0, ec);
 
-        ~SocketContext() {
-            std::error_code ec;
+                // A subscriber that is just slow only misses this notification, others are pruned.
+                if (ec && ec != as::error::would_block) {
+                    ::sd_journal_print(LOG_NOTICE, "pruning subscriber: %s", ec.message().data());
 
-            fs::remove(cfg_.socket_path, ec);
+                    return true;
+                }
+
+                return false;
+            });
         }
 
-        void init() {
-            fs::remove(cfg_.socket_path);
+        void handleDatagram(std::size_t bytes_transferred) {
+            using namespace ::detail;
 
-            sock_.open();
-            sock_.bind(ep_);
+            const auto start = std::chrono::steady_clock::now();
 
-            if (!cfg_.user.empty()) {
-                using fs::perms;
+            ++stats_.frames_received;
 
-                const auto info = get_uid_gid(cfg_.user.data(), cfg_.group.data());
+            if (!receive_time_.has_value()) {
+                receive_time_ = start;
+            }
 
-                fs::permissions(cfg_.socket_path, perms::owner_all | perms::group_all);
+            target_mask_ = kDefaultTargetMask;
 
-                const auto ret = ::chown(cfg_.socket_path.string().data(), info.first, info.second);
-                if (ret != 0) {
-                    throw std::runtime_error{std::string{"fchown() failed: "} + std::strerror(errno)};
+            FrameHandler handler{*this};
+
+            try {
+                const auto status = parse_datagram(std::span{buffer_.data(), bytes_transferred}, handler);
+
+                if (status == ParseStatus::Short) {
+                    ::sd_journal_print(LOG_WARNING, "short command frame");
+                    ++stats_.frames_malformed;
+                } else if (status == ParseStatus::Malformed) {
+                    ::sd_journal_print(LOG_WARNING, "malformed command frame");
+                    ++stats_.frames_malformed;
                 }
+            } catch (const std::runtime_error &err) {
+                ::sd_journal_print(LOG_ERR, "error handling frame: %s", err.what());
+                ++stats_.frames_failed;
             }
+
+            stats_.handle_frame.record(std::chrono::steady_clock::now() - start);
         }
 
-        void start(BacklightContext &bl_ctx, bool verbose) {
-            drop_root_privileges(cfg_.user.data(), cfg_.group.data());
+        /**
+         * Handle all datagrams that are already queued on the socket.
+         *
+         * Used in coalescing mode, so that a burst of frames results in a single commit.
+         */
+        void drain() {
+            using namespace ::detail;
 
-            bl_ctx_  = &bl_ctx;
-            verbose_ = verbose;
+            for (unsigned i = 0; i < kDrainFramesMax; ++i) {
+                boost::system::error_code ec;
 
-            process();
+                const auto bytes_transferred = sock_.receive_from(as::buffer(buffer_), sender_, 0, ec);
+                if (ec == as::error::would_block) {
+                    break;
+                }
+
+                if (ec) {
+                    ::sd_journal_print(LOG_WARNING, "failed to drain socket: %s", ec.message().data());
+                    break;
+                }
+
+                handleDatagram(bytes_transferred);
+            }
         }
 
-    private:
-        void handleFrame(const CommandFrame &frame) {
-            if (frame.type >= CommandType::Count) {
-                ::sd_journal_print(LOG_WARNING, "invalid command frame type: %u", static_cast<unsigned>(frame.type));
-                return;
+        bool isPending() const {
+            if (bl_ctxs_ == nullptr) {
+                return false;
             }
 
-            if (verbose_) {
-                // We need a null-terminated string for sd_journal.
-                const std::string cmd_type{to_string(frame.type)};
+            return std::any_of(bl_ctxs_->cbegin(), bl_ctxs_->cend(), [](const auto &bl_ctx) { return bl_ctx->isPending(); });
+        }
 
-                ::sd_journal_print(LOG_NOTICE, "handling command type: %s", cmd_type.data());
+        /**
+         * Commit all backlights with a pending change in one pass.
+         */
+        void doCommit() {
+            for (auto &bl_ctx : *bl_ctxs_) {
+                try {
+                    bl_ctx->commit();
+                } catch (const std::runtime_error &err) {
+                    ::sd_journal_print(LOG_ERR, "error committing brightness: %s", err.what());
+                }
             }
 
-            switch (frame.type) {
-                case CommandType::SetState: {
-                    if (frame.len != sizeof(std::uint32_t)) {
-                        throw std::runtime_error{"malformed set state"};
-                    }
+            last_commit_ = std::chrono::steady_clock::now();
 
-                    auto set_state = reinterpret_cast<const SetStateFrame *>(&frame);
-                    bl_ctx_->setState(set_state->value);
-                } break;
+            ++stats_.commits;
 
-                case CommandType::ModifyState: {
-                    if (frame.len != sizeof(std::int32_t)) {
-                        throw std::runtime_error{"malformed modify state"};
-                    }
+            if (receive_time_.has_value()) {
+                stats_.receive_to_commit.record(last_commit_ - receive_time_.value());
+                receive_time_.reset();
+            }
+        }
 
-                    auto modify_state = reinterpret_cast<const ModifyStateFrame *>(&frame);
-                    bl_ctx_->modifyState(modify_state->value);
-                } break;
+        /**
+         * Commit the staged brightness, honoring the maximum commit rate.
+         *
+         * If the last commit was too recent, the commit is deferred to a timer. Frames
+         * arriving in the meantime are staged and end up in that deferred commit.
+         */
+        void commit() {
+            if (!isPending()) {
+                // Nothing was staged, so there is no receive-to-commit latency to account for.
+                receive_time_.reset();
+                return;
+            }
 
-                case CommandType::SaveState: {
-                    if (frame.len != 0) {
-                        throw std::runtime_error{"malformed save state"};
-                    }
+            if (commit_deferred_) {
+                return;
+            }
 
-                    bl_ctx_->saveState();
-                } break;
+            if (cfg_.max_commit_rate == 0) {
+                doCommit();
+                return;
+            }
 
-                case CommandType::RestoreState: {
-                    if (frame.len != 0) {
-                        throw std::runtime_error{"malformed restore state"};
-                    }
+            const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::seconds{1}) / cfg_.max_commit_rate;
+            const auto next_commit = last_commit_ + interval;
 
-                    bl_ctx_->restoreState();
-                } break;
+            if (std::chrono::steady_clock::now() >= next_commit) {
+                doCommit();
+                return;
+            }
 
-                case CommandType::SetPowersave: {
-                    if (frame.len != 0) {
-                        throw std::runtime_error{"malformed set powerstate"};
-                    }
+            commit_deferred_ = true;
 
-                    bl_ctx_->setPowersave();
-                } break;
+            commit_timer_.expires_at(next_commit);
+            commit_timer_.async_wait([this](const auto &ec) {
+                commit_deferred_ = false;
 
-                default:
-                    throw std::runtime_error{"unhandled command type"};
-            }
+                if (!ec) {
+                    doCommit();
+                }
+            });
         }
 
         void process() {
-            using namespace ::detail;
-
             buffer_.clear();
             buffer_.resize(::detail::kBufferSize);
 
-            sock_.async_receive(boost::asio::buffer(buffer_), [this](const auto &ec, auto bytes_transferred) {
+            sock_.async_receive_from(boost::asio::buffer(buffer_), sender_, [this](const auto &ec, auto bytes_transferred) {
                 if (!ec) {
-                    if (bytes_transferred < kCommandFrameSizeMin) {
-                        ::sd_journal_print(LOG_WARNING, "short command frame");
-                    } else {
-                        auto frame = reinterpret_cast<const CommandFrame *>(buffer_.data());
-
-                        if (frame->len > kCommandFrameLenMax || frame->len + kCommandFrameSizeMin != bytes_transferred) {
-                            ::sd_journal_print(LOG_WARNING, "malformed command frame");
-                        } else {
-                            try {
-                                handleFrame(*frame);
-                            } catch (const std::runtime_error &err) {
-                                ::sd_journal_print(LOG_ERR, "error handling frame: %s", err.what());
-                            }
-                        }
+                    if (lazy_init_) {
+                        setupBacklights();
+                    }
+
+                    armIdleTimer();
+
+                    handleDatagram(bytes_transferred);
+
+                    if (cfg_.coalesce_frames) {
+                        drain();
                     }
 
+                    commit();
+
                     process();
                 }
             });
@@ -388,53 +1257,202 @@ namespace BrightnessDaemon {
     private:
         as::io_context &ioc_;
         const Config   &cfg_;
+        Stats          &stats_;
 
-        BacklightContext *bl_ctx_{nullptr};
+        BacklightContexts *bl_ctxs_{nullptr};
+
+        std::uint8_t target_mask_{::detail::kDefaultTargetMask};
 
         bool verbose_{false};
 
         proto::socket   sock_;
         proto::endpoint ep_;
+        proto::endpoint sender_;
+
+        as::steady_timer                      commit_timer_;
+        std::chrono::steady_clock::time_point last_commit_{};
+        bool                                  commit_deferred_{false};
+
+        bool                  activated_{false};
+        std::function<void()> lazy_init_;
+        std::function<void()> idle_handler_;
+        as::steady_timer      idle_timer_;
+
+        // Receive time of the first frame that is not yet committed.
+        std::optional<std::chrono::steady_clock::time_point> receive_time_;
+
+        std::vector<proto::endpoint> subscribers_;
+        unsigned                     notify_mask_{0};
 
         std::vector<std::uint8_t> buffer_;
     };
 
+    static void dump_histogram(const char *name, const LatencyHistogram &histogram) {
+        ::sd_journal_print(LOG_NOTICE, "%s: count=%llu avg=%lluus max=%lluus", name,
+            static_cast<unsigned long long>(histogram.count), static_cast<unsigned long long>(histogram.average()),
+            static_cast<unsigned long long>(histogram.max_us));
+
+        for (unsigned i = 0; i < LatencyHistogram::kBuckets; ++i) {
+            if (histogram.buckets[i] == 0) {
+                continue;
+            }
+
+            ::sd_journal_print(LOG_NOTICE, "%s: [%uus, %uus): %u", name, i == 0 ? 0u : 1u << i, 1u << (i + 1), histogram.buckets[i]);
+        }
+    }
+
+    static void dump_stats(const Stats &stats) {
+        ::sd_journal_print(LOG_NOTICE, "frames: received=%u malformed=%u failed=%u, commits=%u, writes=%u",
+            stats.frames_received, stats.frames_malformed, stats.frames_failed, stats.commits, stats.writes);
+
+        dump_histogram("handle frame", stats.handle_frame);
+        dump_histogram("sysfs write", stats.sysfs_write);
+        dump_histogram("receive to commit", stats.receive_to_commit);
+    }
+
+    /**
+     * Dump the statistics to the journal whenever SIGUSR1 is received.
+     */
+    static void wait_stats_signal(as::signal_set &signals, const Stats &stats) {
+        signals.async_wait([&signals, &stats](const auto &ec, [[maybe_unused]] int signal_number) {
+            if (!ec) {
+                dump_stats(stats);
+
+                wait_stats_signal(signals, stats);
+            }
+        });
+    }
+
+    /**
+     * Periodically notify the systemd watchdog.
+     *
+     * @param timer    Timer used for scheduling
+     * @param interval Notification interval
+     */
+    static void kick_watchdog(as::steady_timer &timer, std::chrono::microseconds interval) {
+        ::sd_notify(0, "WATCHDOG=1");
+
+        timer.expires_after(interval);
+        timer.async_wait([&timer, interval](const auto &ec) {
+            if (!ec) {
+                kick_watchdog(timer, interval);
+            }
+        });
+    }
+
 } // namespace BrightnessDaemon
 
 int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
+    const auto startup_time = std::chrono::steady_clock::now();
+
     BrightnessDaemon::Config config;
 
     config.read();
 
     boost::asio::io_context ioc;
 
-    BrightnessDaemon::BacklightContext bl_ctx(config);
-    BrightnessDaemon::SocketContext    sock_ctx(ioc, config);
+    BrightnessDaemon::Stats             stats;
+    BrightnessDaemon::StateStore        store(config.state_path);
+    BrightnessDaemon::StatePageWriter   state_page;
+    BrightnessDaemon::BacklightContexts bl_ctxs;
+    BrightnessDaemon::SocketContext     sock_ctx(ioc, config, stats);
+    BrightnessDaemon::HotplugContext    hotplug_ctx(ioc);
+    BrightnessDaemon::AmbientContext    ambient_ctx(ioc, config);
+
+    store.init(config.user.data(), config.group.data());
+
+    const auto setup_backlights = [&]() {
+        const auto use_state_page = !config.state_page_path.empty();
+
+        if (use_state_page) {
+            state_page.init(config.state_page_path, config.identifiers.size(), config.state_page_futex);
+        }
+
+        for (const auto &identifier : config.identifiers) {
+            auto bl_ctx = std::make_unique<BrightnessDaemon::BacklightContext>(ioc, config, identifier, store, stats);
+
+            if (use_state_page) {
+                bl_ctx->setStatePage(state_page, bl_ctxs.size());
+            }
+
+            bl_ctx->init();
+
+            bl_ctxs.push_back(std::move(bl_ctx));
+        }
+
+        hotplug_ctx.init();
+        hotplug_ctx.start(bl_ctxs);
+
+        if (config.ambient.enabled) {
+            try {
+                ambient_ctx.init();
+                ambient_ctx.start(*bl_ctxs.front());
+            } catch (const std::runtime_error &err) {
+                ::sd_journal_print(LOG_WARNING, "ambient light disabled: %s", err.what());
+            }
+        }
+
+        for (auto &bl_ctx : bl_ctxs) {
+            bl_ctx->restorePersistedState();
+            bl_ctx->commit();
+        }
+    };
 
-    bl_ctx.init();
     sock_ctx.init();
 
-    sock_ctx.start(bl_ctx, false);
+    // With socket activation, resolving the backlights is deferred until the first frame.
+    // Ambient mode has to run without any client, so it is set up right away.
+    if (sock_ctx.isActivated() && !config.ambient.enabled) {
+        sock_ctx.setLazyInit(setup_backlights);
+        sock_ctx.setIdleHandler([&ioc]() {
+            ::sd_notify(0, "STOPPING=1");
+
+            ioc.stop();
+        });
+    } else {
+        setup_backlights();
+    }
 
-    bl_ctx.restoreState();
+    sock_ctx.start(bl_ctxs, false);
 
     boost::asio::signal_set signals(ioc, SIGTERM, SIGINT);
 
-    signals.async_wait([](const auto &ec, int signal_number) {
+    signals.async_wait([&ioc](const auto &ec, int signal_number) {
         if (!ec) {
             ::sd_journal_print(LOG_NOTICE, "received signal: %d", signal_number);
+            ::sd_notify(0, "STOPPING=1");
 
-            ::detail::running = false;
+            ioc.stop();
         }
     });
 
-    ::detail::running = true;
+    boost::asio::signal_set stats_signals(ioc, SIGUSR1);
 
-    while (::detail::running) {
-        ioc.run_one();
+    BrightnessDaemon::wait_stats_signal(stats_signals, stats);
+
+    boost::asio::steady_timer watchdog_timer(ioc);
+
+    std::uint64_t watchdog_usec{0};
+    if (::sd_watchdog_enabled(0, &watchdog_usec) > 0) {
+        // Notify at twice the rate that systemd expects.
+        BrightnessDaemon::kick_watchdog(watchdog_timer, std::chrono::microseconds{watchdog_usec / 2});
     }
 
-    bl_ctx.saveState();
+    ::sd_notify(0, "READY=1");
+
+    const auto startup_duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startup_time);
+
+    ::sd_journal_print(LOG_NOTICE, "ready after %lld us", static_cast<long long>(startup_duration.count()));
+
+    ioc.run();
+
+    for (auto &bl_ctx : bl_ctxs) {
+        try {
+            bl_ctx->persistState();
+        } catch (const std::runtime_error &err) {
+            ::sd_journal_print(LOG_ERR, "failed to save brightness state: %s", err.what());
+        }
+    }
 
     return 0;
 }
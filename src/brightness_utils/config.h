@@ -4,20 +4,27 @@
 #define __BRIGHTNESS_UTILS_CONFIG_H_
 
 #include "common.h"
+#include "curve.h"
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <string_view>
 #include <string>
 #include <system_error>
+#include <vector>
 
 namespace detail {
 
     static const std::filesystem::path kConfigPath{"/etc/brightness-daemon.conf"};
 
+    // Limited by the width of the target selection mask in the wire protocol.
+    static constexpr unsigned kBacklightsMax{8};
+
 } // namespace detail
 
 namespace BrightnessDaemon {
@@ -28,17 +35,142 @@ namespace BrightnessDaemon {
 
     using namespace std::string_view_literals;
 
+    struct TransitionConfig {
+        // Duration of a full transition (zero disables transitions).
+        std::chrono::milliseconds duration{0};
+
+        Curve curve;
+
+        void parse(const jsn &data) {
+            duration = std::chrono::milliseconds{data.at("duration"sv).get<unsigned>()};
+
+            if (data.contains("curve"sv)) {
+                curve.type = parse_curve_type(data.at("curve"sv).get<std::string>());
+            }
+
+            if (data.contains("gamma"sv)) {
+                data.at("gamma"sv).get_to(curve.gamma);
+            }
+
+            if (curve.gamma <= 0.0) {
+                throw std::runtime_error{"invalid gamma value"};
+            }
+        }
+    };
+
+    struct StepConfig {
+        unsigned count{20};
+
+        Curve curve{.type = CurveType::CIELightness};
+
+        void parse(const jsn &data) {
+            if (data.contains("count"sv)) {
+                data.at("count"sv).get_to(count);
+            }
+
+            if (data.contains("curve"sv)) {
+                curve.type = parse_curve_type(data.at("curve"sv).get<std::string>());
+            }
+
+            if (data.contains("gamma"sv)) {
+                data.at("gamma"sv).get_to(curve.gamma);
+            }
+
+            if (count == 0 || curve.gamma <= 0.0) {
+                throw std::runtime_error{"invalid perceptual step config"};
+            }
+        }
+    };
+
+    struct AmbientConfig {
+        bool enabled{false};
+
+        // Name of the IIO device and the illuminance channel to use.
+        std::string device_name;
+        std::string channel{"in_illuminance"};
+
+        AmbientCurve curve;
+
+        // Weight of a new sample in the exponential moving average of the illuminance.
+        double filter{0.2};
+
+        // Minimum brightness change (in percent) that is applied.
+        double hysteresis{5.0};
+
+        // How long a manual change biases the curve.
+        std::chrono::seconds bias_timeout{300};
+
+        void parse(const jsn &data) {
+            if (data.contains("enabled"sv) && !data.at("enabled"sv).get<bool>()) {
+                return;
+            }
+
+            data.at("device-name"sv).get_to(device_name);
+
+            if (data.contains("channel"sv)) {
+                data.at("channel"sv).get_to(channel);
+            }
+
+            for (const auto &point : data.at("curve"sv)) {
+                curve.points.emplace_back(point.at(0).get<double>(), point.at(1).get<double>());
+            }
+
+            if (curve.points.empty() || !std::is_sorted(curve.points.cbegin(), curve.points.cend())) {
+                throw std::runtime_error{"invalid ambient light curve"};
+            }
+
+            if (data.contains("filter"sv)) {
+                data.at("filter"sv).get_to(filter);
+            }
+
+            if (filter <= 0.0 || filter > 1.0) {
+                throw std::runtime_error{"invalid ambient light filter"};
+            }
+
+            if (data.contains("hysteresis"sv)) {
+                data.at("hysteresis"sv).get_to(hysteresis);
+            }
+
+            if (data.contains("bias-timeout"sv)) {
+                bias_timeout = std::chrono::seconds{data.at("bias-timeout"sv).get<unsigned>()};
+            }
+
+            enabled = true;
+        }
+    };
+
     struct Config {
         std::string user;
         std::string group;
 
-        BacklightIdentifier identifier;
+        std::vector<BacklightIdentifier> identifiers;
 
         fs::path state_path;
         fs::path socket_path;
 
         unsigned powersave_value;
 
+        // Coalesce bursts of queued frames into a single commit.
+        bool coalesce_frames{false};
+
+        // Maximum number of backlight commits per second (zero means unlimited).
+        unsigned max_commit_rate{0};
+
+        TransitionConfig transition;
+
+        // Perceptual steps used by the StepUp/StepDown commands.
+        StepConfig steps;
+
+        // Exit after being idle for this long (only with socket activation, zero disables).
+        std::chrono::seconds idle_timeout{0};
+
+        // Auto-brightness for the first backlight.
+        AmbientConfig ambient;
+
+        // Shared memory state page for readers (empty path disables it).
+        fs::path state_page_path;
+        bool     state_page_futex{false};
+
         void read() {
             using namespace ::detail;
 
@@ -61,13 +193,59 @@ namespace BrightnessDaemon {
                 config_data.at("group"sv).get_to(group);
             }
 
-            identifier.parse(config_data.at("backlight-identifier"));
+            // Either a single identifier, or an array of them (for multiple backlights).
+            const auto &identifier_data = config_data.at("backlight-identifier"sv);
+
+            if (identifier_data.is_array()) {
+                for (const auto &entry : identifier_data) {
+                    identifiers.emplace_back().parse(entry);
+                }
+            } else {
+                identifiers.emplace_back().parse(identifier_data);
+            }
+
+            if (identifiers.empty() || identifiers.size() > kBacklightsMax) {
+                throw std::runtime_error{"invalid number of backlight identifiers"};
+            }
 
             config_data.at("state-path").get_to(state_path);
             config_data.at("socket-path").get_to(socket_path);
 
             config_data.at("powersave-value").get_to(powersave_value);
+
+            if (config_data.contains("coalesce-frames"sv)) {
+                config_data.at("coalesce-frames"sv).get_to(coalesce_frames);
+            }
+
+            if (config_data.contains("max-commit-rate"sv)) {
+                config_data.at("max-commit-rate"sv).get_to(max_commit_rate);
+            }
+
+            if (config_data.contains("transition"sv)) {
+                transition.parse(config_data.at("transition"sv));
+            }
+
+            if (config_data.contains("perceptual-steps"sv)) {
+                steps.parse(config_data.at("perceptual-steps"sv));
+            }
+
+            if (config_data.contains("idle-timeout"sv)) {
+                idle_timeout = std::chrono::seconds{config_data.at("idle-timeout"sv).get<unsigned>()};
+            }
+
+            if (config_data.contains("ambient-light"sv)) {
+                ambient.parse(config_data.at("ambient-light"sv));
+            }
+
+            if (config_data.contains("state-page-path"sv)) {
+                config_data.at("state-page-path"sv).get_to(state_page_path);
+            }
+
+            if (config_data.contains("state-page-futex"sv)) {
+                config_data.at("state-page-futex"sv).get_to(state_page_futex);
+            }
         }
+
     };
 
 } // namespace BrightnessDaemon
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_CURVE_H_)
+#define __BRIGHTNESS_UTILS_CURVE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace BrightnessDaemon {
+
+    using namespace std::string_view_literals;
+
+    enum class CurveType : unsigned {
+        Linear,
+        Gamma,
+        CIELightness,
+    };
+
+    static CurveType parse_curve_type(std::string_view input) {
+        if (input == "linear"sv) {
+            return CurveType::Linear;
+        }
+
+        if (input == "gamma"sv) {
+            return CurveType::Gamma;
+        }
+
+        if (input == "cie-lstar"sv) {
+            return CurveType::CIELightness;
+        }
+
+        throw std::runtime_error{"invalid curve type"};
+    }
+
+    /**
+     * Brightness curve mapping raw backlight values to a normalized domain.
+     *
+     * The normalized domain is [0, 1]. For the gamma and CIE L* curves it is
+     * perceptual, i.e. equal distances in the domain are roughly equal perceived
+     * changes.
+     */
+    struct Curve {
+        CurveType type{CurveType::Linear};
+        double    gamma{2.2};
+
+        double normalize(unsigned value, unsigned max_value) const {
+            if (max_value == 0) {
+                return 0.0;
+            }
+
+            const auto linear = static_cast<double>(value) / static_cast<double>(max_value);
+
+            switch (type) {
+                case CurveType::Gamma:
+                    return std::pow(linear, 1.0 / gamma);
+
+                case CurveType::CIELightness:
+                    // CIE 1976 lightness, scaled to [0, 1].
+                    return (linear <= 0.008856 ? 903.3 * linear : 116.0 * std::cbrt(linear) - 16.0) / 100.0;
+
+                default:
+                    return linear;
+            }
+        }
+
+        unsigned denormalize(double position, unsigned max_value) const {
+            position = std::clamp(position, 0.0, 1.0);
+
+            double linear;
+
+            switch (type) {
+                case CurveType::Gamma:
+                    linear = std::pow(position, gamma);
+                    break;
+
+                case CurveType::CIELightness: {
+                    const auto lightness = position * 100.0;
+
+                    linear = lightness <= 8.0 ? lightness / 903.3 : std::pow((lightness + 16.0) / 116.0, 3.0);
+                } break;
+
+                default:
+                    linear = position;
+                    break;
+            }
+
+            return static_cast<unsigned>(std::lround(std::clamp(linear, 0.0, 1.0) * static_cast<double>(max_value)));
+        }
+
+        /**
+         * Build a lookup table of raw values for equidistant steps along the curve.
+         *
+         * @param steps     Number of steps
+         * @param max_value Maximum raw value
+         *
+         * The table starts at zero, ends at the maximum value and is strictly
+         * increasing. On panels with few raw levels, steps that would map to the
+         * same raw value are merged, so the table can be shorter than requested.
+         */
+        std::vector<unsigned> buildSteps(unsigned steps, unsigned max_value) const {
+            std::vector<unsigned> table;
+
+            table.reserve(steps + 1);
+
+            for (unsigned i = 0; i <= steps; ++i) {
+                const auto value = denormalize(static_cast<double>(i) / static_cast<double>(steps), max_value);
+
+                if (table.empty() || value > table.back()) {
+                    table.push_back(value);
+                }
+            }
+
+            return table;
+        }
+
+        /**
+         * Interpolate between two raw values along the curve.
+         *
+         * @param from      Start value
+         * @param to        End value
+         * @param t         Interpolation parameter in [0, 1]
+         * @param max_value Maximum raw value
+         */
+        unsigned interpolate(unsigned from, unsigned to, double t, unsigned max_value) const {
+            const auto a = normalize(from, max_value);
+            const auto b = normalize(to, max_value);
+
+            return denormalize(a + (b - a) * std::clamp(t, 0.0, 1.0), max_value);
+        }
+    };
+
+    /**
+     * Mapping from ambient illuminance (in lux) to brightness (in percent).
+     *
+     * The curve is given by control points and interpolated linearly over
+     * log10(1 + lux), which matches how illuminance is perceived.
+     */
+    struct AmbientCurve {
+        std::vector<std::pair<double, double>> points;
+
+        double evaluate(double lux) const {
+            if (points.empty()) {
+                return 100.0;
+            }
+
+            if (lux <= points.front().first) {
+                return points.front().second;
+            }
+
+            if (lux >= points.back().first) {
+                return points.back().second;
+            }
+
+            const auto it = std::find_if(points.cbegin(), points.cend(), [lux](const auto &point) { return point.first > lux; });
+            const auto &lower = *std::prev(it);
+            const auto &upper = *it;
+
+            const auto x  = std::log10(1.0 + lux);
+            const auto x0 = std::log10(1.0 + lower.first);
+            const auto x1 = std::log10(1.0 + upper.first);
+
+            return lower.second + (upper.second - lower.second) * (x - x0) / (x1 - x0);
+        }
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_CURVE_H_
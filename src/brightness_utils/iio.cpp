@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "iio.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace detail {
+
+    static const std::filesystem::path kIIOBasePath{"/sys/bus/iio/devices"};
+    static const std::filesystem::path kDevBasePath{"/dev"};
+
+    // Number of samples the kernel buffer can hold.
+    static constexpr unsigned kIIOBufferLength{16};
+
+} // namespace detail
+
+namespace BrightnessDaemon {
+
+    using namespace std::string_view_literals;
+
+    namespace {
+
+        struct ScanType {
+            bool     big_endian;
+            bool     is_signed;
+            unsigned realbits;
+            unsigned storagebits;
+            unsigned shift;
+        };
+
+        struct ScanElement {
+            std::string name;
+            unsigned    index;
+            ScanType    type;
+        };
+
+        std::optional<std::string> read_attr(const fs::path &path) {
+            std::ifstream stream(path);
+            if (!stream.good()) {
+                return std::nullopt;
+            }
+
+            std::string data;
+            stream >> data;
+
+            return data;
+        }
+
+        void write_attr(const fs::path &path, std::string_view value) {
+            std::ofstream stream;
+
+            stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            stream.open(path);
+
+            stream << value;
+            stream.flush();
+        }
+
+        /**
+         * Parse a scan element type, e.g. "le:s12/16>>4".
+         */
+        ScanType parse_scan_type(const std::string &input) {
+            char endianness[3]{};
+            char sign{};
+
+            ScanType type{};
+
+            const auto ret = std::sscanf(input.data(), "%2[bl]e:%c%u/%u>>%u", endianness, &sign, &type.realbits, &type.storagebits, &type.shift);
+            if (ret != 5 || (sign != 's' && sign != 'u') || type.storagebits == 0 || type.storagebits > 64 || type.storagebits % 8 != 0) {
+                throw std::runtime_error{"unsupported IIO scan type"};
+            }
+
+            type.big_endian = endianness[0] == 'b';
+            type.is_signed  = sign == 's';
+
+            return type;
+        }
+
+        std::vector<ScanElement> enabled_scan_elements(const fs::path &scan_path) {
+            std::vector<ScanElement> elements;
+
+            for (const auto &entry : fs::directory_iterator{scan_path}) {
+                const auto filename = entry.path().filename().string();
+
+                if (!filename.ends_with("_en"sv)) {
+                    continue;
+                }
+
+                if (read_attr(entry.path()).value_or("0") != "1") {
+                    continue;
+                }
+
+                const auto name = filename.substr(0, filename.size() - 3);
+
+                const auto index = read_attr(scan_path / (name + "_index"));
+                const auto type = read_attr(scan_path / (name + "_type"));
+
+                if (!index.has_value() || !type.has_value()) {
+                    throw std::runtime_error{"incomplete IIO scan element"};
+                }
+
+                elements.push_back(ScanElement{
+                    .name  = name,
+                    .index = static_cast<unsigned>(std::stoul(index.value())),
+                    .type  = parse_scan_type(type.value()),
+                });
+            }
+
+            std::sort(elements.begin(), elements.end(), [](const auto &a, const auto &b) { return a.index < b.index; });
+
+            return elements;
+        }
+
+        std::optional<fs::path> lookup_iio_device(const std::string &device_name) {
+            using namespace ::detail;
+
+            if (!fs::is_directory(kIIOBasePath)) {
+                return std::nullopt;
+            }
+
+            for (const auto &entry : fs::directory_iterator{kIIOBasePath}) {
+                if (!entry.path().filename().string().starts_with("iio:device"sv)) {
+                    continue;
+                }
+
+                if (read_attr(entry.path() / "name"sv) == device_name) {
+                    return entry.path();
+                }
+            }
+
+            return std::nullopt;
+        }
+
+    } // namespace
+
+    IIOBufferedChannel::~IIOBufferedChannel() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+
+        if (buffer_enabled_) {
+            try {
+                write_attr(device_path_ / "buffer/enable"sv, "0"sv);
+            } catch (...) {
+                // We might have lost the privileges to do this.
+            }
+        }
+    }
+
+    void IIOBufferedChannel::init(const std::string &device_name, const std::string &channel) {
+        using namespace ::detail;
+
+        const auto device = lookup_iio_device(device_name);
+        if (!device.has_value()) {
+            throw std::runtime_error{"failed to lookup IIO device"};
+        }
+
+        device_path_ = device.value();
+
+        const auto scan_path = device_path_ / "scan_elements"sv;
+
+        // The scan layout can only be changed while the buffer is disabled.
+        write_attr(device_path_ / "buffer/enable"sv, "0"sv);
+        write_attr(scan_path / (channel + "_en"), "1"sv);
+        write_attr(device_path_ / "buffer/length"sv, std::to_string(kIIOBufferLength));
+
+        std::size_t offset{0};
+        std::size_t max_bytes{1};
+        bool        found{false};
+
+        for (const auto &element : enabled_scan_elements(scan_path)) {
+            const auto bytes = element.type.storagebits / 8;
+
+            // Every element is naturally aligned to its storage size.
+            offset = (offset + bytes - 1) / bytes * bytes;
+
+            if (element.name == channel) {
+                offset_      = offset;
+                big_endian_  = element.type.big_endian;
+                is_signed_   = element.type.is_signed;
+                realbits_    = element.type.realbits;
+                storagebits_ = element.type.storagebits;
+                shift_       = element.type.shift;
+
+                found = true;
+            }
+
+            offset += bytes;
+            max_bytes = std::max<std::size_t>(max_bytes, bytes);
+        }
+
+        if (!found) {
+            throw std::runtime_error{"IIO channel not enabled"};
+        }
+
+        // The sample as a whole is aligned to its largest element.
+        sample_size_ = (offset + max_bytes - 1) / max_bytes * max_bytes;
+
+        scale_        = std::stod(read_attr(device_path_ / (channel + "_scale")).value_or("1"));
+        value_offset_ = std::stod(read_attr(device_path_ / (channel + "_offset")).value_or("0"));
+
+        write_attr(device_path_ / "buffer/enable"sv, "1"sv);
+        buffer_enabled_ = true;
+
+        const auto dev_node = kDevBasePath / device_path_.filename();
+
+        fd_ = ::open(dev_node.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd_ < 0) {
+            throw std::runtime_error{std::string{"open() failed: "} + std::strerror(errno)};
+        }
+    }
+
+    double IIOBufferedChannel::decode(const std::uint8_t *sample) const {
+        const auto bytes = storagebits_ / 8;
+        const auto data = sample + offset_;
+
+        std::uint64_t raw{0};
+
+        for (unsigned i = 0; i < bytes; ++i) {
+            const auto byte = big_endian_ ? data[i] : data[bytes - 1 - i];
+
+            raw = (raw << 8) | byte;
+        }
+
+        raw >>= shift_;
+
+        if (realbits_ < 64) {
+            raw &= (std::uint64_t{1} << realbits_) - 1;
+        }
+
+        std::int64_t value = static_cast<std::int64_t>(raw);
+
+        if (is_signed_ && realbits_ < 64 && (raw & (std::uint64_t{1} << (realbits_ - 1))) != 0) {
+            value -= static_cast<std::int64_t>(std::uint64_t{1} << realbits_);
+        }
+
+        return (static_cast<double>(value) + value_offset_) * scale_;
+    }
+
+} // namespace BrightnessDaemon
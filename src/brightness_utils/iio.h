@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_IIO_H_)
+#define __BRIGHTNESS_UTILS_IIO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace BrightnessDaemon {
+
+    namespace fs = std::filesystem;
+
+    /**
+     * Single channel of an IIO device, read through the buffered interface.
+     *
+     * Samples are read from the character device (/dev/iio:deviceN) instead of
+     * polling the sysfs attribute. The scan layout of all enabled channels is
+     * computed, so that other users of the buffer don't break decoding.
+     */
+    class IIOBufferedChannel {
+    public:
+        IIOBufferedChannel() = default;
+
+        IIOBufferedChannel([[maybe_unused]] const IIOBufferedChannel &rhs) = delete;
+        void operator=([[maybe_unused]] const IIOBufferedChannel &rhs) = delete;
+
+        ~IIOBufferedChannel();
+
+        /**
+         * Setup the buffered channel.
+         *
+         * @param device_name Name of the IIO device (as in its name attribute)
+         * @param channel     Channel name, e.g. in_illuminance
+         *
+         * Enables the channel and the buffer, which needs root privileges.
+         */
+        void init(const std::string &device_name, const std::string &channel);
+
+        /**
+         * Descriptor of the character device (opened non-blocking).
+         */
+        int fd() const {
+            return fd_;
+        }
+
+        std::size_t sampleSize() const {
+            return sample_size_;
+        }
+
+        /**
+         * Decode the channel value from a sample, with offset and scale applied.
+         *
+         * @param sample Pointer to a sample of sampleSize() bytes
+         */
+        double decode(const std::uint8_t *sample) const;
+
+    private:
+        fs::path device_path_;
+
+        int fd_{-1};
+
+        bool buffer_enabled_{false};
+
+        std::size_t sample_size_{0};
+        std::size_t offset_{0};
+
+        bool     big_endian_{false};
+        bool     is_signed_{false};
+        unsigned realbits_{0};
+        unsigned storagebits_{0};
+        unsigned shift_{0};
+
+        double scale_{1.0};
+        double value_offset_{0.0};
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_IIO_H_
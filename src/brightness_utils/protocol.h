@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_PROTOCOL_H_)
+#define __BRIGHTNESS_UTILS_PROTOCOL_H_
+
+#include "stats.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+namespace detail {
+
+    using namespace std::string_view_literals;
+
+    static constexpr unsigned kCommandFrameLenMax{32};
+    static constexpr unsigned kCommandFrameSizeMin{2};
+
+    // Batch frames may use the full range of the length field.
+    static constexpr unsigned kBatchFrameLenMax{255};
+    static constexpr unsigned kBatchFrameSizeMin{2};
+    static constexpr std::uint8_t kBatchVersion{1};
+
+    // Used in replies for values that are not available.
+    static constexpr std::uint32_t kInvalidValue{0xffffffff};
+
+    // One byte more than the largest valid frame, so that oversized datagrams are detected.
+    static constexpr unsigned kBufferSize{kCommandFrameSizeMin + kBatchFrameLenMax + 1};
+
+    static constexpr std::array kCommandTypeStrings{
+        "SetState"sv,
+        "ModifyState"sv,
+        "SaveState"sv,
+        "RestoreState"sv,
+        "SetPowersave"sv,
+        "Batch"sv,
+        "GetState"sv,
+        "Subscribe"sv,
+        "Unsubscribe"sv,
+        "SelectTarget"sv,
+        "GetStats"sv,
+        "StepUp"sv,
+        "StepDown"sv,
+    };
+
+} // namespace detail
+
+namespace BrightnessDaemon {
+
+    enum class CommandType : std::uint8_t {
+        SetState,
+        ModifyState,
+        SaveState,
+        RestoreState,
+        SetPowersave,
+        Batch,
+        GetState,
+        Subscribe,
+        Unsubscribe,
+        SelectTarget,
+        GetStats,
+        StepUp,
+        StepDown,
+
+        Count,
+    };
+
+    struct CommandFrame {
+        CommandType  type;
+        std::uint8_t len;
+        std::uint8_t value[];
+    };
+
+    struct SetStateFrame {
+        CommandType   type;
+        std::uint8_t  len;
+        std::uint32_t value;
+    } __attribute__((packed));
+
+    struct ModifyStateFrame {
+        CommandType   type;
+        std::uint8_t  len;
+        std::int32_t value;
+    } __attribute__((packed));
+
+    /**
+     * Select the backlights that the following commands apply to.
+     *
+     * The value is a bitmask of backlight indices (in config order). The
+     * selection is only valid for the rest of the datagram, i.e. it is
+     * typically used as the first entry of a batch.
+     */
+    struct SelectTargetFrame {
+        CommandType  type;
+        std::uint8_t len;
+        std::uint8_t mask;
+    } __attribute__((packed));
+
+    /**
+     * Batch of sub-commands in a single datagram.
+     *
+     * The payload is a sequence of (unpadded) command frames, which are executed
+     * in order and result in a single commit. Batches can't be nested.
+     */
+    struct BatchFrame {
+        CommandType  type;
+        std::uint8_t len;
+        std::uint8_t version;
+        std::uint8_t count;
+        std::uint8_t frames[];
+    } __attribute__((packed));
+
+    /**
+     * Reply to a GetState command.
+     *
+     * The sequence number is incremented on every write to the backlight, so
+     * clients can cheaply detect changes. The saved value is kInvalidValue if
+     * nothing was saved or restored yet.
+     */
+    struct StateReplyFrame {
+        CommandType   type;
+        std::uint8_t  len;
+        std::uint32_t sequence;
+        std::uint32_t current;
+        std::uint32_t max;
+        std::uint32_t saved;
+    } __attribute__((packed));
+
+    /**
+     * Change notification sent to subscribers.
+     *
+     * Uses the Subscribe command type. Notifications are coalesced, so the
+     * sequence number may advance by more than one between two of them.
+     */
+    struct NotifyFrame {
+        CommandType   type;
+        std::uint8_t  len;
+        std::uint8_t  target;
+        std::uint32_t sequence;
+        std::uint32_t current;
+    } __attribute__((packed));
+
+    /**
+     * Reply to a GetStats command.
+     *
+     * The histograms use the bucket layout of LatencyHistogram.
+     */
+    struct StatsReplyFrame {
+        CommandType   type;
+        std::uint8_t  len;
+        std::uint32_t frames_received;
+        std::uint32_t frames_malformed;
+        std::uint32_t frames_failed;
+        std::uint32_t commits;
+        std::uint32_t writes;
+        std::uint32_t handle_frame[LatencyHistogram::kBuckets];
+        std::uint32_t sysfs_write[LatencyHistogram::kBuckets];
+        std::uint32_t receive_to_commit[LatencyHistogram::kBuckets];
+    } __attribute__((packed));
+
+    static_assert(sizeof(StatsReplyFrame) - ::detail::kCommandFrameSizeMin <= ::detail::kBatchFrameLenMax);
+
+    static inline auto to_string(const CommandType& ct) {
+        switch (ct) {
+            case CommandType::SetState:
+            case CommandType::ModifyState:
+            case CommandType::SaveState:
+            case CommandType::RestoreState:
+            case CommandType::SetPowersave:
+            case CommandType::Batch:
+            case CommandType::GetState:
+            case CommandType::Subscribe:
+            case CommandType::Unsubscribe:
+            case CommandType::SelectTarget:
+            case CommandType::GetStats:
+            case CommandType::StepUp:
+            case CommandType::StepDown:
+                return ::detail::kCommandTypeStrings[static_cast<unsigned>(ct)];
+
+            default:
+                throw std::runtime_error{"invalid command type"};
+        }
+    }
+
+    /**
+     * Result of parsing the outer frame of a datagram.
+     *
+     * Errors in the frame content (e.g. a wrong length for the command type)
+     * are reported by exception instead, like errors of the handler itself.
+     */
+    enum class ParseStatus {
+        Ok,
+        Short,
+        Malformed,
+    };
+
+    /**
+     * Validate a single command frame and dispatch it to a handler.
+     *
+     * @param frame   The command frame, with at least frame.len bytes of payload
+     * @param handler The handler
+     *
+     * The handler is called with onCommand() first, then with the callback of
+     * the specific command. Batches are forwarded to dispatch_batch().
+     */
+    template<typename Handler>
+    void dispatch_frame(const CommandFrame &frame, Handler &handler);
+
+    /**
+     * Payload length of a command frame, for all types except Batch.
+     */
+    static inline unsigned payload_len(CommandType type) {
+        switch (type) {
+            case CommandType::SetState:
+                return sizeof(std::uint32_t);
+
+            case CommandType::ModifyState:
+                return sizeof(std::int32_t);
+
+            case CommandType::SelectTarget:
+                return sizeof(std::uint8_t);
+
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Validate the entries of a batch frame and dispatch them in order.
+     *
+     * @param batch   The batch frame, with at least batch.len bytes of payload
+     * @param handler The handler
+     *
+     * The whole payload is validated before the first entry is dispatched, so
+     * a rejected batch has no partial effect.
+     */
+    template<typename Handler>
+    void dispatch_batch(const BatchFrame &batch, Handler &handler) {
+        using namespace ::detail;
+
+        if (batch.len < kBatchFrameSizeMin) {
+            throw std::runtime_error{"malformed batch"};
+        }
+
+        if (batch.version != kBatchVersion) {
+            throw std::runtime_error{"unsupported batch version"};
+        }
+
+        const auto payload_size = static_cast<unsigned>(batch.len - kBatchFrameSizeMin);
+
+        unsigned offset{0};
+
+        for (unsigned i = 0; i < batch.count; ++i) {
+            if (offset + kCommandFrameSizeMin > payload_size) {
+                throw std::runtime_error{"truncated batch"};
+            }
+
+            auto frame = reinterpret_cast<const CommandFrame *>(batch.frames + offset);
+
+            if (frame->type >= CommandType::Count) {
+                throw std::runtime_error{"invalid batch entry type"};
+            }
+
+            if (frame->type == CommandType::Batch) {
+                throw std::runtime_error{"nested batch"};
+            }
+
+            if (frame->len != payload_len(frame->type) || offset + kCommandFrameSizeMin + frame->len > payload_size) {
+                throw std::runtime_error{"malformed batch entry"};
+            }
+
+            offset += kCommandFrameSizeMin + frame->len;
+        }
+
+        if (offset != payload_size) {
+            throw std::runtime_error{"trailing batch data"};
+        }
+
+        offset = 0;
+
+        for (unsigned i = 0; i < batch.count; ++i) {
+            auto frame = reinterpret_cast<const CommandFrame *>(batch.frames + offset);
+
+            dispatch_frame(*frame, handler);
+
+            offset += kCommandFrameSizeMin + frame->len;
+        }
+    }
+
+    template<typename Handler>
+    void dispatch_frame(const CommandFrame &frame, Handler &handler) {
+        if (frame.type >= CommandType::Count) {
+            throw std::runtime_error{"invalid command frame type"};
+        }
+
+        handler.onCommand(frame.type);
+
+        switch (frame.type) {
+            case CommandType::SetState: {
+                if (frame.len != sizeof(std::uint32_t)) {
+                    throw std::runtime_error{"malformed set state"};
+                }
+
+                handler.onSetState(reinterpret_cast<const SetStateFrame *>(&frame)->value);
+            } break;
+
+            case CommandType::ModifyState: {
+                if (frame.len != sizeof(std::int32_t)) {
+                    throw std::runtime_error{"malformed modify state"};
+                }
+
+                handler.onModifyState(reinterpret_cast<const ModifyStateFrame *>(&frame)->value);
+            } break;
+
+            case CommandType::SaveState: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed save state"};
+                }
+
+                handler.onSaveState();
+            } break;
+
+            case CommandType::RestoreState: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed restore state"};
+                }
+
+                handler.onRestoreState();
+            } break;
+
+            case CommandType::SetPowersave: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed set powerstate"};
+                }
+
+                handler.onSetPowersave();
+            } break;
+
+            case CommandType::SelectTarget: {
+                if (frame.len != sizeof(std::uint8_t)) {
+                    throw std::runtime_error{"malformed select target"};
+                }
+
+                handler.onSelectTarget(reinterpret_cast<const SelectTargetFrame *>(&frame)->mask);
+            } break;
+
+            case CommandType::GetStats: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed get stats"};
+                }
+
+                handler.onGetStats();
+            } break;
+
+            case CommandType::StepUp: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed step up"};
+                }
+
+                handler.onStep(1);
+            } break;
+
+            case CommandType::StepDown: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed step down"};
+                }
+
+                handler.onStep(-1);
+            } break;
+
+            case CommandType::Batch: {
+                dispatch_batch(*reinterpret_cast<const BatchFrame *>(&frame), handler);
+            } break;
+
+            case CommandType::GetState: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed get state"};
+                }
+
+                handler.onGetState();
+            } break;
+
+            case CommandType::Subscribe: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed subscribe"};
+                }
+
+                handler.onSubscribe();
+            } break;
+
+            case CommandType::Unsubscribe: {
+                if (frame.len != 0) {
+                    throw std::runtime_error{"malformed unsubscribe"};
+                }
+
+                handler.onUnsubscribe();
+            } break;
+
+            default:
+                throw std::runtime_error{"unhandled command type"};
+        }
+    }
+
+    /**
+     * Parse a datagram and dispatch the contained command(s) to a handler.
+     *
+     * @param data    The datagram
+     * @param handler The handler
+     *
+     * This has no state and does no I/O, so it can be driven directly by a
+     * fuzzer or a benchmark. Content errors are thrown as std::runtime_error.
+     */
+    template<typename Handler>
+    ParseStatus parse_datagram(std::span<const std::uint8_t> data, Handler &handler) {
+        using namespace ::detail;
+
+        if (data.size() < kCommandFrameSizeMin) {
+            return ParseStatus::Short;
+        }
+
+        auto frame = reinterpret_cast<const CommandFrame *>(data.data());
+
+        const auto len_max = frame->type == CommandType::Batch ? kBatchFrameLenMax : kCommandFrameLenMax;
+
+        if (frame->len > len_max || frame->len + kCommandFrameSizeMin != data.size()) {
+            return ParseStatus::Malformed;
+        }
+
+        dispatch_frame(*frame, handler);
+
+        return ParseStatus::Ok;
+    }
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_PROTOCOL_H_
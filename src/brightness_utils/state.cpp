@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "state.h"
+
+#include <fcntl.h>
+#include <systemd/sd-journal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace detail {
+
+    static constexpr std::uint32_t kStateMagic{0x54534442}; // "BDST"
+    static constexpr std::uint16_t kStateVersion{2};
+
+    // Limited by the width of the entry count in the header.
+    static constexpr unsigned kStateEntriesMax{0xffff};
+
+} // namespace detail
+
+namespace BrightnessDaemon {
+
+    namespace {
+
+        struct Header {
+            std::uint32_t magic;
+            std::uint16_t version;
+            std::uint16_t count;
+            std::uint32_t checksum;
+            std::uint32_t reserved;
+        };
+
+        /**
+         * Plain bitwise CRC-32 (IEEE 802.3), the record is tiny.
+         */
+        std::uint32_t crc32(const std::uint8_t *data, std::size_t size, std::uint32_t crc = 0) {
+            crc = ~crc;
+
+            for (std::size_t i = 0; i < size; ++i) {
+                crc ^= data[i];
+
+                for (unsigned k = 0; k < 8; ++k) {
+                    crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+                }
+            }
+
+            return ~crc;
+        }
+
+        void write_all(int fd, const void *data, std::size_t size) {
+            auto ptr = static_cast<const std::uint8_t *>(data);
+
+            while (size != 0) {
+                const auto ret = ::write(fd, ptr, size);
+                if (ret < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
+                    throw std::runtime_error{std::string{"write() failed: "} + std::strerror(errno)};
+                }
+
+                ptr  += ret;
+                size -= ret;
+            }
+        }
+
+        void sync_directory(const fs::path &path) {
+            const auto fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::runtime_error{std::string{"open() failed: "} + std::strerror(errno)};
+            }
+
+            const auto ret = ::fsync(fd);
+
+            ::close(fd);
+
+            if (ret != 0) {
+                throw std::runtime_error{std::string{"fsync() failed: "} + std::strerror(errno)};
+            }
+        }
+
+    } // namespace
+
+    void StateStore::init(const char *username, const char *groupname) {
+        const auto parent = path_.parent_path();
+
+        // Only a directory that we create ourselves is handed to the daemon user, an
+        // existing one (which might be shared, e.g. /var/lib) is set up by tmpfiles.d instead.
+        const auto created = !fs::is_directory(parent) && fs::create_directories(parent);
+
+        if (created && username != nullptr && username[0] != '\0') {
+            const auto info = get_uid_gid(username, groupname != nullptr && groupname[0] != '\0' ? groupname : nullptr);
+
+            const auto ret = ::chown(parent.c_str(), info.first, info.second);
+            if (ret != 0) {
+                throw std::runtime_error{std::string{"chown() failed: "} + std::strerror(errno)};
+            }
+        }
+
+        load();
+    }
+
+    std::optional<unsigned> StateStore::get(const BacklightIdentifier &ident, StateSlot slot) const {
+        const auto it = find(ident, slot);
+        if (it == entries_.cend()) {
+            return std::nullopt;
+        }
+
+        return it->value;
+    }
+
+    void StateStore::put(const BacklightIdentifier &ident, StateSlot slot, unsigned value) {
+        auto it = find(ident, slot);
+
+        if (it == entries_.end()) {
+            if (entries_.size() >= ::detail::kStateEntriesMax) {
+                throw std::runtime_error{"too many state entries"};
+            }
+
+            Entry entry{};
+
+            std::strncpy(entry.prefix, ident.prefix.data(), sizeof(entry.prefix) - 1);
+            entry.vendor_id = ident.vendor_id;
+            entry.device_id = ident.device_id;
+            entry.slot      = slot;
+
+            it = entries_.insert(entries_.end(), entry);
+        }
+
+        it->value = value;
+    }
+
+    void StateStore::erase(const BacklightIdentifier &ident, StateSlot slot) {
+        const auto it = find(ident, slot);
+        if (it != entries_.end()) {
+            entries_.erase(it);
+        }
+    }
+
+    void StateStore::flush() const {
+        using namespace ::detail;
+
+        Header header{
+            .magic    = kStateMagic,
+            .version  = kStateVersion,
+            .count    = static_cast<std::uint16_t>(entries_.size()),
+            .checksum = 0,
+            .reserved = 0,
+        };
+
+        const auto entries_data = reinterpret_cast<const std::uint8_t *>(entries_.data());
+        const auto entries_size = entries_.size() * sizeof(Entry);
+
+        header.checksum = crc32(entries_data, entries_size, crc32(reinterpret_cast<const std::uint8_t *>(&header), sizeof(header)));
+
+        auto tmp_path = path_;
+        tmp_path += ".tmp";
+
+        const auto fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error{std::string{"open() failed: "} + std::strerror(errno)};
+        }
+
+        try {
+            write_all(fd, &header, sizeof(header));
+            write_all(fd, entries_data, entries_size);
+
+            if (::fsync(fd) != 0) {
+                throw std::runtime_error{std::string{"fsync() failed: "} + std::strerror(errno)};
+            }
+        } catch (...) {
+            ::close(fd);
+            ::unlink(tmp_path.c_str());
+
+            throw;
+        }
+
+        ::close(fd);
+
+        if (::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            throw std::runtime_error{std::string{"rename() failed: "} + std::strerror(errno)};
+        }
+
+        sync_directory(path_.parent_path());
+    }
+
+    void StateStore::load() {
+        using namespace ::detail;
+
+        entries_.clear();
+
+        const auto fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno != ENOENT) {
+                ::sd_journal_print(LOG_WARNING, "failed to open state file: %s", std::strerror(errno));
+            }
+
+            return;
+        }
+
+        Header header{};
+
+        auto ret = ::pread(fd, &header, sizeof(header), 0);
+
+        if (ret != sizeof(header) || header.magic != kStateMagic || header.version != kStateVersion) {
+            ::sd_journal_print(LOG_WARNING, "ignoring invalid state file");
+            ::close(fd);
+
+            return;
+        }
+
+        std::vector<Entry> entries(header.count);
+
+        const auto entries_size = entries.size() * sizeof(Entry);
+
+        ret = ::pread(fd, entries.data(), entries_size, sizeof(header));
+
+        ::close(fd);
+
+        const auto checksum = header.checksum;
+        header.checksum = 0;
+
+        const auto computed = crc32(reinterpret_cast<const std::uint8_t *>(entries.data()), entries_size,
+            crc32(reinterpret_cast<const std::uint8_t *>(&header), sizeof(header)));
+
+        if (ret < 0 || static_cast<std::size_t>(ret) != entries_size || computed != checksum) {
+            ::sd_journal_print(LOG_WARNING, "ignoring corrupted state file");
+
+            return;
+        }
+
+        entries_ = std::move(entries);
+    }
+
+    std::vector<StateStore::Entry>::iterator StateStore::find(const BacklightIdentifier &ident, StateSlot slot) {
+        return std::find_if(entries_.begin(), entries_.end(), [&ident, slot](const auto &entry) {
+            return entry.slot == slot && entry.vendor_id == ident.vendor_id && entry.device_id == ident.device_id &&
+                std::strncmp(entry.prefix, ident.prefix.data(), sizeof(entry.prefix) - 1) == 0;
+        });
+    }
+
+    std::vector<StateStore::Entry>::const_iterator StateStore::find(const BacklightIdentifier &ident, StateSlot slot) const {
+        return const_cast<StateStore *>(this)->find(ident, slot);
+    }
+
+} // namespace BrightnessDaemon
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_STATE_H_)
+#define __BRIGHTNESS_UTILS_STATE_H_
+
+#include "common.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace BrightnessDaemon {
+
+    namespace fs = std::filesystem;
+
+    /**
+     * Slots of the state record.
+     *
+     * Saved is used by the SaveState/RestoreState commands, Persisted holds the
+     * brightness that is carried over a restart of the daemon.
+     */
+    enum class StateSlot : std::uint32_t {
+        Saved,
+        Persisted,
+    };
+
+    /**
+     * Persistent brightness state, keyed by backlight identifier.
+     *
+     * The state file is a small versioned record with a CRC-32 checksum. It is
+     * always replaced as a whole (write to temporary file, fsync, rename), so a
+     * crash during a save leaves either the old or the new record behind. A
+     * record with a bad magic, version or checksum is ignored.
+     */
+    class StateStore {
+    public:
+        StateStore(const fs::path &path) : path_(path) {}
+
+        /**
+         * Prepare the state directory and load the record.
+         *
+         * @param username  User that needs write access to the state directory (optional)
+         * @param groupname Group of that user (optional)
+         *
+         * Has to be called before dropping root privileges, since the temporary
+         * file is created in the state directory. The directory is only chowned
+         * if it is created here, so it should be dedicated to the daemon.
+         */
+        void init(const char *username, const char *groupname);
+
+        std::optional<unsigned> get(const BacklightIdentifier &ident, StateSlot slot) const;
+
+        void put(const BacklightIdentifier &ident, StateSlot slot, unsigned value);
+        void erase(const BacklightIdentifier &ident, StateSlot slot);
+
+        /**
+         * Atomically write the record to the state file.
+         */
+        void flush() const;
+
+    private:
+        struct Entry {
+            char          prefix[32];
+            std::uint16_t vendor_id;
+            std::uint16_t device_id;
+            StateSlot     slot;
+            std::uint32_t value;
+        };
+
+        void load();
+
+        std::vector<Entry>::iterator find(const BacklightIdentifier &ident, StateSlot slot);
+        std::vector<Entry>::const_iterator find(const BacklightIdentifier &ident, StateSlot slot) const;
+
+    private:
+        fs::path path_;
+
+        std::vector<Entry> entries_;
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_STATE_H_
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "state_page.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+namespace BrightnessDaemon {
+
+    StatePageWriter::~StatePageWriter() {
+        if (page_ != nullptr) {
+            ::munmap(page_, sizeof(StatePage));
+        }
+    }
+
+    void StatePageWriter::init(const fs::path &path, unsigned count, bool futex_wake) {
+        if (count > kStatePageEntries) {
+            throw std::runtime_error{"too many backlights for state page"};
+        }
+
+        const auto parent = path.parent_path();
+
+        if (!fs::is_directory(parent)) {
+            fs::create_directories(parent);
+        }
+
+        const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error{std::string{"open() failed: "} + std::strerror(errno)};
+        }
+
+        if (::ftruncate(fd, sizeof(StatePage)) != 0) {
+            const auto err = errno;
+
+            ::close(fd);
+
+            throw std::runtime_error{std::string{"ftruncate() failed: "} + std::strerror(err)};
+        }
+
+        auto mapping = ::mmap(nullptr, sizeof(StatePage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        ::close(fd);
+
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error{std::string{"mmap() failed: "} + std::strerror(errno)};
+        }
+
+        std::memset(mapping, 0, sizeof(StatePage));
+
+        page_ = new (mapping) StatePage{};
+
+        page_->magic   = kStatePageMagic;
+        page_->version = kStatePageVersion;
+        page_->count   = count;
+
+        futex_wake_ = futex_wake;
+    }
+
+    void StatePageWriter::update(unsigned index, std::uint32_t current, std::uint32_t max, std::uint32_t saved) {
+        if (page_ == nullptr || index >= page_->count) {
+            return;
+        }
+
+        ::timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        const auto sequence = page_->sequence.load(std::memory_order_relaxed);
+
+        page_->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        auto &entry = page_->entries[index];
+
+        entry.current      = current;
+        entry.max          = max;
+        entry.saved        = saved;
+        entry.generation  += 1;
+        entry.timestamp_ns = static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
+
+        page_->sequence.store(sequence + 2, std::memory_order_release);
+
+        if (futex_wake_) {
+            // Shared mapping, so this can't be a private futex.
+            ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&page_->sequence), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+} // namespace BrightnessDaemon
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_STATE_PAGE_H_)
+#define __BRIGHTNESS_UTILS_STATE_PAGE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+
+namespace BrightnessDaemon {
+
+    namespace fs = std::filesystem;
+
+    static constexpr std::uint32_t kStatePageMagic{0x50534442}; // "BDSP"
+    static constexpr std::uint32_t kStatePageVersion{1};
+    static constexpr unsigned kStatePageEntries{8};
+
+    struct StatePageEntry {
+        std::uint32_t current;
+        std::uint32_t max;
+        std::uint32_t saved;
+        std::uint32_t reserved;
+
+        // Incremented on every change of the entry.
+        std::uint64_t generation;
+
+        // CLOCK_MONOTONIC timestamp of the last change (in nanoseconds).
+        std::uint64_t timestamp_ns;
+    };
+
+    /**
+     * Brightness state page, shared with readers through a file mapping.
+     *
+     * The page is protected by a seqlock: the sequence counter is odd while
+     * the daemon updates the page. Readers retry until they see the same even
+     * value before and after copying an entry. The sequence counter also
+     * serves as futex word for change wakeups (if enabled in the daemon).
+     */
+    struct StatePage {
+        std::uint32_t              magic;
+        std::uint32_t              version;
+        std::uint32_t              count;
+        std::atomic<std::uint32_t> sequence;
+
+        StatePageEntry entries[kStatePageEntries];
+    };
+
+    static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+
+    /**
+     * Read an entry from a (read-only) mapped state page.
+     *
+     * @param page  The mapped page
+     * @param index Index of the backlight
+     */
+    static inline StatePageEntry read_state_page(const StatePage &page, unsigned index) {
+        StatePageEntry entry;
+
+        while (true) {
+            const auto before = page.sequence.load(std::memory_order_acquire);
+
+            if ((before & 1) == 0) {
+                entry = page.entries[index];
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (page.sequence.load(std::memory_order_relaxed) == before) {
+                    return entry;
+                }
+            }
+        }
+    }
+
+    /**
+     * Daemon side of the state page.
+     */
+    class StatePageWriter {
+    public:
+        StatePageWriter() = default;
+
+        StatePageWriter([[maybe_unused]] const StatePageWriter &rhs) = delete;
+        void operator=([[maybe_unused]] const StatePageWriter &rhs) = delete;
+
+        ~StatePageWriter();
+
+        /**
+         * Create and map the state page.
+         *
+         * @param path       Path of the backing file (usually below /run)
+         * @param count      Number of backlights
+         * @param futex_wake Wake futex waiters on the sequence counter after each update
+         */
+        void init(const fs::path &path, unsigned count, bool futex_wake);
+
+        /**
+         * Update the entry of a backlight.
+         *
+         * @param index   Index of the backlight
+         * @param current Current brightness
+         * @param max     Maximum brightness
+         * @param saved   Saved brightness
+         */
+        void update(unsigned index, std::uint32_t current, std::uint32_t max, std::uint32_t saved);
+
+    private:
+        StatePage *page_{nullptr};
+
+        bool futex_wake_{false};
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_STATE_PAGE_H_
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_STATS_H_)
+#define __BRIGHTNESS_UTILS_STATS_H_
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+namespace BrightnessDaemon {
+
+    /**
+     * Latency histogram with logarithmic buckets.
+     *
+     * Bucket i counts samples in [2^i, 2^(i+1)) microseconds. The first bucket
+     * also holds everything below one microsecond, the last one everything above.
+     */
+    struct LatencyHistogram {
+        static constexpr unsigned kBuckets{16};
+
+        std::array<std::uint32_t, kBuckets> buckets{};
+
+        std::uint64_t count{0};
+        std::uint64_t total_us{0};
+        std::uint64_t max_us{0};
+
+        void record(std::chrono::steady_clock::duration duration) {
+            const auto us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+            const auto index = us == 0 ? 0u : static_cast<unsigned>(std::bit_width(us) - 1);
+
+            ++buckets[std::min(index, kBuckets - 1)];
+
+            ++count;
+            total_us += us;
+            max_us = std::max(max_us, us);
+        }
+
+        std::uint64_t average() const {
+            return count == 0 ? 0 : total_us / count;
+        }
+    };
+
+    /**
+     * Hot-path counters of the brightness daemon.
+     *
+     * Everything runs on the event loop thread, so plain integers are enough.
+     */
+    struct Stats {
+        std::uint32_t frames_received{0};
+        std::uint32_t frames_malformed{0};
+        std::uint32_t frames_failed{0};
+        std::uint32_t commits{0};
+        std::uint32_t writes{0};
+
+        // Time spent in handleFrame().
+        LatencyHistogram handle_frame;
+
+        // Time spent writing the brightness sysfs node.
+        LatencyHistogram sysfs_write;
+
+        // Time from receiving the first frame of a batch until its commit.
+        LatencyHistogram receive_to_commit;
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_STATS_H_
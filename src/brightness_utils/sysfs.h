@@ -5,16 +5,26 @@
 
 #include "common.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cctype>
 #include <filesystem>
 #include <fstream>
 #include <optional>
 #include <string_view>
 #include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 namespace detail {
 
     static const std::filesystem::path kSysfsBasePath{"/sys/class/backlight"};
+    static const std::filesystem::path kDiscoveryCachePath{"/run/brightness-daemon/discovery"};
 
 } // namespace detail
 
@@ -35,85 +45,155 @@ namespace BrightnessDaemon {
     }
 
     /**
-     * Check if a device path belongs to a parent device.
+     * Read from a sysfs path.
      *
-     * @param path The device path to check
+     * Returns the read result as a string, or None if the read failed.
+     *
+     * @param path The path from which to read
      */
-    static bool is_parent_device(const fs::path &path) {
-        for (const auto &arg : {"class"sv, "vendor"sv, "device"sv}) {
-            if (!fs::is_regular_file(path / arg)) {
-                return false;
-            }
+    static std::optional<std::string> read_sysfs(const fs::path &path) {
+        std::ifstream stream;
+
+        stream.open(path);
+        if (stream.good()) {
+            std::string data;
+            stream >> data;
+
+            return rstrip(data);
         }
 
-        return true;
+        return std::nullopt;
     }
 
     /**
-     * Get the parent device path for a device.
-     *
-     * @param path The device path to use
+     * Scoped file descriptor, used for the *at() based directory walks.
      */
-    static auto get_parent_device(const fs::path &path) {
-        auto current_path = path;
+    class ScopedFD {
+    public:
+        explicit ScopedFD(int fd) : fd_(fd) {}
 
-        std::optional<decltype(current_path)> parent_device;
+        ScopedFD([[maybe_unused]] const ScopedFD &rhs) = delete;
+        void operator=([[maybe_unused]] const ScopedFD &rhs) = delete;
 
-        while (true) {
-            if (is_parent_device(current_path)) {
-                parent_device = current_path;
-                break;
+        ~ScopedFD() {
+            if (fd_ >= 0) {
+                ::close(fd_);
             }
+        }
 
-            const auto next_path = current_path / "device"sv;
-            if (!fs::is_symlink(next_path)) {
-                break;
+        int get() const {
+            return fd_;
+        }
+
+        int release() {
+            return std::exchange(fd_, -1);
+        }
+
+        void reset(int fd) {
+            if (fd_ >= 0) {
+                ::close(fd_);
             }
 
-            current_path = next_path;
+            fd_ = fd;
+        }
+
+    private:
+        int fd_;
+    };
+
+    /**
+     * Read a small sysfs attribute relative to a directory descriptor.
+     *
+     * @param dirfd Directory descriptor
+     * @param name  Name of the attribute
+     */
+    static std::optional<std::string> read_sysfs_at(int dirfd, const char *name) {
+        ScopedFD fd{::openat(dirfd, name, O_RDONLY | O_CLOEXEC)};
+        if (fd.get() < 0) {
+            return std::nullopt;
         }
 
-        return parent_device;
+        char buffer[64];
+
+        const auto ret = ::read(fd.get(), buffer, sizeof(buffer));
+        if (ret <= 0) {
+            return std::nullopt;
+        }
+
+        std::string_view data{buffer, static_cast<std::size_t>(ret)};
+
+        while (!data.empty() && std::isspace(static_cast<unsigned char>(data.back()))) {
+            data.remove_suffix(1);
+        }
+
+        return std::string{data};
+    }
+
+    static bool is_regular_file_at(int dirfd, const char *name) {
+        struct ::stat st;
+
+        return ::fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
     }
 
     /**
-     * Read from a sysfs path.
+     * Check if a device directory belongs to a parent device.
      *
-     * Returns the read result as a string, or None if the read failed.
+     * @param dirfd Descriptor of the device directory to check
+     */
+    static bool is_parent_device_at(int dirfd) {
+        for (const auto arg : {"class", "vendor", "device"}) {
+            if (!is_regular_file_at(dirfd, arg)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Get the parent device for a device, following the device symlinks.
      *
-     * @param path The path from which to read
+     * @param dirfd Descriptor of the device directory (ownership is taken)
+     *
+     * Returns a descriptor of the parent device directory, or -1 if there is none.
      */
-    static std::optional<std::string> read_sysfs(const fs::path &path) {
-        std::ifstream stream;
+    static int get_parent_device_at(int dirfd) {
+        ScopedFD current{dirfd};
 
-        stream.open(path);
-        if (stream.good()) {
-            std::string data;
-            stream >> data;
+        while (current.get() >= 0) {
+            if (is_parent_device_at(current.get())) {
+                return current.release();
+            }
 
-            return rstrip(data);
+            struct ::stat st;
+
+            if (::fstatat(current.get(), "device", &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISLNK(st.st_mode)) {
+                break;
+            }
+
+            current.reset(::openat(current.get(), "device", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
         }
 
-        return std::nullopt;
+        return -1;
     }
 
     /**
      * Identify the backlight device.
      *
-     * @param path  sysfs path to the backlight node
-     * @param ident backlight identfier
+     * @param dirfd Descriptor of the parent device directory
+     * @param ident Backlight identfier
      *
-     * Returns true if the information from the sysfs path matches
+     * Returns true if the vendor/device IDs of the parent device match
      * the identifier, and false if not.
      */
-    static bool identify_backlight(const fs::path &path, const BacklightIdentifier &ident) {
+    static bool identify_backlight_at(int dirfd, const BacklightIdentifier &ident) {
         std::uint16_t vendor_id;
         std::uint16_t device_id;
 
         try {
-            vendor_id = std::stoi(read_sysfs(path / "vendor"sv).value(), nullptr, 16);
-            device_id = std::stoi(read_sysfs(path / "device"sv).value(), nullptr, 16);
-        } catch ([[maybe_unusued]] const std::exception &exc) {
+            vendor_id = std::stoi(read_sysfs_at(dirfd, "vendor").value(), nullptr, 16);
+            device_id = std::stoi(read_sysfs_at(dirfd, "device").value(), nullptr, 16);
+        } catch ([[maybe_unused]] const std::exception &exc) {
             return false;
         }
 
@@ -121,41 +201,209 @@ namespace BrightnessDaemon {
     }
 
     /**
-     * Lookup the sysfs path to the backlight node.
+     * Scan the backlight class for a node matching the identifier.
      *
      * @param ident Backlight identfier
      *
-     * Returns the sysfs path to the node, or nullopt if nothing was found.
+     * All lookups are done relative to directory descriptors, so that no
+     * path is resolved from scratch. Returns the node name, or nullopt.
      */
-    static std::optional<fs::path> lookup_backlight_node(const BacklightIdentifier &ident) {
+    static std::optional<std::string> scan_backlight_nodes(const BacklightIdentifier &ident) {
         using namespace ::detail;
 
-        if (!fs::is_directory(kSysfsBasePath)) {
+        const auto base_fd = ::open(kSysfsBasePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (base_fd < 0) {
             return std::nullopt;
         }
 
-        for (const auto &dir_entry : fs::directory_iterator{kSysfsBasePath}) {
-            if (!dir_entry.is_symlink()) {
+        // The directory stream takes ownership of the descriptor.
+        auto dir = ::fdopendir(base_fd);
+        if (dir == nullptr) {
+            ::close(base_fd);
+
+            return std::nullopt;
+        }
+
+        std::optional<std::string> result;
+
+        while (auto entry = ::readdir(dir)) {
+            const std::string_view name{entry->d_name};
+
+            if (name.rfind(ident.prefix, 0) != 0) {
                 continue;
             }
 
-            const auto &p = dir_entry.path();
+            // Backlight class entries are symlinks to the device directory.
+            struct ::stat st;
+
+            if (::fstatat(base_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISLNK(st.st_mode)) {
+                continue;
+            }
 
-            if (p.filename().string().rfind(ident.prefix, 0) != 0) {
+            const auto node_fd = ::openat(base_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (node_fd < 0) {
                 continue;
             }
 
-            auto parent = get_parent_device(p);
-            if (!parent.has_value()) {
+            ScopedFD parent{get_parent_device_at(node_fd)};
+            if (parent.get() < 0) {
                 continue;
             }
 
-            if (identify_backlight(parent.value(), ident)) {
-                return p;
+            if (identify_backlight_at(parent.get(), ident)) {
+                result = std::string{name};
+                break;
             }
         }
 
-        return std::nullopt;
+        ::closedir(dir);
+
+        return result;
+    }
+
+    /**
+     * Cache of resolved backlight nodes.
+     *
+     * Each line holds the identifier (prefix, vendor and device ID of the parent),
+     * the node name and the inode of the node directory. Since sysfs allocates new
+     * inodes when a device is recreated (e.g. after a driver reload), an entry is
+     * validated with a single stat() of the node.
+     */
+    class DiscoveryCache {
+    private:
+        struct Entry {
+            std::string   prefix;
+            std::uint16_t vendor_id;
+            std::uint16_t device_id;
+            std::string   node;
+            ::ino_t       inode;
+        };
+
+    public:
+        DiscoveryCache() {
+            using namespace ::detail;
+
+            std::ifstream stream(kDiscoveryCachePath);
+
+            Entry entry;
+
+            while (stream >> entry.prefix >> std::hex >> entry.vendor_id >> entry.device_id >> entry.node >> std::dec >> entry.inode) {
+                entries_.push_back(entry);
+            }
+        }
+
+        /**
+         * Get the cached node for an identifier, if the entry is still valid.
+         */
+        std::optional<fs::path> get(const BacklightIdentifier &ident) const {
+            using namespace ::detail;
+
+            const auto it = find(ident);
+            if (it == entries_.cend()) {
+                return std::nullopt;
+            }
+
+            const auto path = kSysfsBasePath / it->node;
+
+            struct ::stat st;
+
+            if (::stat(path.c_str(), &st) != 0 || st.st_ino != it->inode) {
+                return std::nullopt;
+            }
+
+            return path;
+        }
+
+        /**
+         * Record a resolved node and write the cache.
+         *
+         * This is best effort, failing to write the cache only costs a full scan later.
+         */
+        void put(const BacklightIdentifier &ident, const std::string &node) {
+            using namespace ::detail;
+
+            const auto path = kSysfsBasePath / node;
+
+            struct ::stat st;
+
+            if (::stat(path.c_str(), &st) != 0) {
+                return;
+            }
+
+            std::erase_if(entries_, [&ident](const auto &entry) { return matches(entry, ident); });
+
+            entries_.push_back(Entry{
+                .prefix    = ident.prefix,
+                .vendor_id = ident.vendor_id,
+                .device_id = ident.device_id,
+                .node      = node,
+                .inode     = st.st_ino,
+            });
+
+            std::error_code ec;
+
+            fs::create_directories(kDiscoveryCachePath.parent_path(), ec);
+
+            auto tmp_path = kDiscoveryCachePath;
+            tmp_path += ".tmp";
+
+            {
+                std::ofstream stream(tmp_path, std::ofstream::trunc);
+
+                for (const auto &entry : entries_) {
+                    stream << entry.prefix << ' ' << std::hex << entry.vendor_id << ' ' << entry.device_id << ' '
+                           << entry.node << ' ' << std::dec << entry.inode << '\n';
+                }
+
+                if (!stream.good()) {
+                    return;
+                }
+            }
+
+            fs::rename(tmp_path, kDiscoveryCachePath, ec);
+        }
+
+    private:
+        static bool matches(const Entry &entry, const BacklightIdentifier &ident) {
+            return entry.prefix == ident.prefix && entry.vendor_id == ident.vendor_id && entry.device_id == ident.device_id;
+        }
+
+        std::vector<Entry>::const_iterator find(const BacklightIdentifier &ident) const {
+            return std::find_if(entries_.cbegin(), entries_.cend(), [&ident](const auto &entry) { return matches(entry, ident); });
+        }
+
+    private:
+        std::vector<Entry> entries_;
+    };
+
+    /**
+     * Lookup the sysfs path to the backlight node.
+     *
+     * @param ident Backlight identfier
+     *
+     * Tries the discovery cache first, and only falls back to a full scan of
+     * the backlight class if the cached entry is missing or stale.
+     *
+     * Returns the sysfs path to the node, or nullopt if nothing was found.
+     */
+    static std::optional<fs::path> lookup_backlight_node(const BacklightIdentifier &ident) {
+        using namespace ::detail;
+
+        DiscoveryCache cache;
+
+        auto path = cache.get(ident);
+        if (path.has_value()) {
+            return path;
+        }
+
+        const auto node = scan_backlight_nodes(ident);
+        if (!node.has_value()) {
+            return std::nullopt;
+        }
+
+        cache.put(ident, node.value());
+
+        return kSysfsBasePath / node.value();
     }
 
 } // namespace BrightnessDaemon
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#if !defined(__BRIGHTNESS_UTILS_SYSFS_ATTRIBUTE_H_)
+#define __BRIGHTNESS_UTILS_SYSFS_ATTRIBUTE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace detail {
+
+    // Enough for any unsigned 32-bit value plus a trailing newline.
+    static constexpr unsigned kSysfsValueBufferSize{16};
+
+} // namespace detail
+
+namespace BrightnessDaemon {
+
+    namespace fs = std::filesystem;
+
+    /**
+     * Raw file descriptor handle to a sysfs attribute.
+     *
+     * The attribute is kept open for the lifetime of the object. Values are
+     * formatted into a stack buffer and transferred with a single pread()/pwrite()
+     * at offset zero, so no heap allocation or stream state is involved.
+     */
+    class SysfsAttribute {
+    public:
+        SysfsAttribute() = default;
+
+        SysfsAttribute([[maybe_unused]] const SysfsAttribute &rhs) = delete;
+        void operator=([[maybe_unused]] const SysfsAttribute &rhs) = delete;
+
+        SysfsAttribute(SysfsAttribute &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+        ~SysfsAttribute() {
+            close();
+        }
+
+        void open(const fs::path &path) {
+            close();
+
+            fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+            if (fd_ < 0) {
+                throw std::runtime_error{std::string{"open() failed: "} + std::strerror(errno)};
+            }
+        }
+
+        void close() noexcept {
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        bool is_open() const noexcept {
+            return fd_ >= 0;
+        }
+
+        /**
+         * Read the attribute as an unsigned integer.
+         */
+        unsigned read() const {
+            using namespace ::detail;
+
+            char buffer[kSysfsValueBufferSize];
+
+            const auto ret = ::pread(fd_, buffer, sizeof(buffer), 0);
+            if (ret < 0) {
+                throw std::runtime_error{std::string{"pread() failed: "} + std::strerror(errno)};
+            }
+
+            unsigned value{};
+
+            const auto result = std::from_chars(buffer, buffer + ret, value);
+            if (result.ec != std::errc()) {
+                throw std::runtime_error{"malformed sysfs value"};
+            }
+
+            return value;
+        }
+
+        /**
+         * Write an unsigned integer to the attribute.
+         *
+         * @param value The value to write
+         */
+        void write(const unsigned value) const {
+            using namespace ::detail;
+
+            char buffer[kSysfsValueBufferSize];
+
+            const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+            const auto length = static_cast<std::size_t>(result.ptr - buffer);
+
+            const auto ret = ::pwrite(fd_, buffer, length, 0);
+            if (ret < 0) {
+                throw std::runtime_error{std::string{"pwrite() failed: "} + std::strerror(errno)};
+            }
+
+            if (static_cast<std::size_t>(ret) != length) {
+                throw std::runtime_error{"short sysfs write"};
+            }
+        }
+
+    private:
+        int fd_{-1};
+    };
+
+} // namespace BrightnessDaemon
+
+#endif // __BRIGHTNESS_UTILS_SYSFS_ATTRIBUTE_H_
@@ -6,16 +6,21 @@
 #include <boost/process/v1/child.hpp>
 #include <boost/process/v1/io.hpp>
 #include <boost/program_options.hpp>
+#include <dlfcn.h>
 #include <nlohmann/json.hpp>
 #include <unistd.h>
 
+#include <cmath>
 #include <csignal>
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <system_error>
 #include <utility>
 #include <vector>
@@ -27,34 +32,59 @@ namespace CPUPowerlimit {
     using jsn = nlohmann::json;
 
     static const fs::path kRyzenAdj{"/usr/bin/ryzenadj"};
+    static constexpr const char *kLibRyzenAdj{"libryzenadj.so"};
     static const fs::path kConfigPath{"/etc/cpu-powerlimits.conf"};
     static const fs::path kLockPath{"/run/lock/cpu-powerlimits.lock"};
 
     static constexpr std::pair<float, float> kPowerlimitTDPBounds{8.0, 54.0};
 
-    static std::string limit_scale(float value) {
-        const auto rescaled = static_cast<unsigned>(std::lround(value * 1000.0f));
-
-        return std::to_string(rescaled);
+    static std::uint32_t limit_scale(float value) {
+        return static_cast<std::uint32_t>(std::lround(value * 1000.0f));
     }
 
     static bool bounds_check(float value) {
         return value >= kPowerlimitTDPBounds.first && value <= kPowerlimitTDPBounds.second;
     }
 
-    class LimitProfile {
+    /**
+     * Limit values in the units that ryzenadj expects.
+     */
+    struct LimitValues {
+        std::uint32_t stapm_limit;
+        std::uint32_t fast_limit;
+        std::uint32_t slow_limit;
+
+        std::optional<std::uint32_t> tctl_temp;
+    };
+
+    /**
+     * Interface for the mechanism that applies limits to the hardware.
+     */
+    class LimitBackend {
+    public:
+        virtual ~LimitBackend() = default;
+
+        virtual void apply(const LimitValues &values) = 0;
+
+        virtual std::string_view name() const = 0;
+    };
+
+    /**
+     * Backend that runs the ryzenadj executable for every change.
+     */
+    class ProcessBackend : public LimitBackend {
     public:
-        void apply() const {
+        void apply(const LimitValues &values) override {
             namespace bp = boost::process::v1;
 
             std::vector<std::string> args{
-                std::string{"--stapm-limit="} + limit_scale(stapm_limit_),
-                std::string{"--fast-limit="} + limit_scale(fast_limit_),
-                std::string{"--slow-limit="} + limit_scale(slow_limit_),
+                std::string{"--stapm-limit="} + std::to_string(values.stapm_limit),
+                std::string{"--fast-limit="} + std::to_string(values.fast_limit),
+                std::string{"--slow-limit="} + std::to_string(values.slow_limit),
             };
 
-            if (tctl_temp_.has_value()) {
-                args.push_back(std::string{"--tctl-temp="} + limit_scale(tctl_temp_.value()));
+            if (values.tctl_temp.has_value()) {
+                args.push_back(std::string{"--tctl-temp="} + std::to_string(values.tctl_temp.value()));
             }
 
             bp::child c(kRyzenAdj, args, bp::std_err > bp::null);
@@ -66,6 +96,173 @@ namespace CPUPowerlimit {
             }
         }
 
+        std::string_view name() const override {
+            return "process";
+        }
+    };
+
+    /**
+     * Backend that uses libryzenadj in-process.
+     *
+     * The library is loaded at runtime, so that it stays an optional dependency.
+     * It is initialized once and reused for all changes, e.g. for the restore
+     * after a profile was applied.
+     */
+    class LibraryBackend : public LimitBackend {
+    public:
+        LibraryBackend() = default;
+
+        LibraryBackend([[maybe_unused]] const LibraryBackend &rhs) = delete;
+        void operator=([[maybe_unused]] const LibraryBackend &rhs) = delete;
+
+        ~LibraryBackend() override {
+            if (access_ != nullptr) {
+                cleanup_(access_);
+            }
+
+            if (handle_ != nullptr) {
+                ::dlclose(handle_);
+            }
+        }
+
+        void init() {
+            handle_ = ::dlopen(kLibRyzenAdj, RTLD_NOW | RTLD_LOCAL);
+            if (handle_ == nullptr) {
+                throw std::system_error(ENOENT, std::generic_category());
+            }
+
+            lookup(init_, "init_ryzenadj");
+            lookup(cleanup_, "cleanup_ryzenadj");
+            lookup(set_stapm_limit_, "set_stapm_limit");
+            lookup(set_fast_limit_, "set_fast_limit");
+            lookup(set_slow_limit_, "set_slow_limit");
+            lookup(set_tctl_temp_, "set_tctl_temp");
+
+            access_ = init_();
+            if (access_ == nullptr) {
+                throw std::system_error(ENODEV, std::generic_category());
+            }
+        }
+
+        void apply(const LimitValues &values) override {
+            check(set_stapm_limit_(access_, values.stapm_limit));
+            check(set_fast_limit_(access_, values.fast_limit));
+            check(set_slow_limit_(access_, values.slow_limit));
+
+            if (values.tctl_temp.has_value()) {
+                check(set_tctl_temp_(access_, values.tctl_temp.value()));
+            }
+        }
+
+        std::string_view name() const override {
+            return "library";
+        }
+
+    private:
+        // Opaque handle of libryzenadj.
+        using Access = void *;
+
+        using InitFunc = Access (*)();
+        using CleanupFunc = void (*)(Access);
+        using SetFunc = int (*)(Access, std::uint32_t);
+
+        template<typename Func>
+        void lookup(Func &func, const char *symbol) {
+            func = reinterpret_cast<Func>(::dlsym(handle_, symbol));
+            if (func == nullptr) {
+                throw std::system_error(ENOSYS, std::generic_category());
+            }
+        }
+
+        static void check(int ret) {
+            if (ret != 0) {
+                throw std::system_error(EFAULT, std::generic_category());
+            }
+        }
+
+        void *handle_{nullptr};
+        Access access_{nullptr};
+
+        InitFunc init_{nullptr};
+        CleanupFunc cleanup_{nullptr};
+        SetFunc set_stapm_limit_{nullptr};
+        SetFunc set_fast_limit_{nullptr};
+        SetFunc set_slow_limit_{nullptr};
+        SetFunc set_tctl_temp_{nullptr};
+    };
+
+    /**
+     * Backend that only logs the values, for testing without hardware access.
+     */
+    class StubBackend : public LimitBackend {
+    public:
+        void apply(const LimitValues &values) override {
+            std::cout << "info: stub backend: stapm=" << values.stapm_limit << " fast=" << values.fast_limit
+                      << " slow=" << values.slow_limit;
+
+            if (values.tctl_temp.has_value()) {
+                std::cout << " tctl=" << values.tctl_temp.value();
+            }
+
+            std::cout << std::endl;
+        }
+
+        std::string_view name() const override {
+            return "stub";
+        }
+    };
+
+    /**
+     * Create a backend by name.
+     *
+     * @param name One of "process", "library", "stub" or "auto"
+     *
+     * With "auto" the library backend is used if libryzenadj is available, and
+     * the process backend otherwise.
+     */
+    static std::unique_ptr<LimitBackend> make_backend(std::string_view name) {
+        if (name == "process") {
+            return std::make_unique<ProcessBackend>();
+        }
+
+        if (name == "stub") {
+            return std::make_unique<StubBackend>();
+        }
+
+        if (name == "library" || name == "auto") {
+            auto backend = std::make_unique<LibraryBackend>();
+
+            try {
+                backend->init();
+            } catch (const std::system_error &err) {
+                if (name == "library") {
+                    throw;
+                }
+
+                std::cout << "info: libryzenadj not usable, falling back to ryzenadj process: " << err.what() << std::endl;
+
+                return std::make_unique<ProcessBackend>();
+            }
+
+            return backend;
+        }
+
+        throw std::system_error(EINVAL, std::generic_category());
+    }
+
+    class LimitProfile {
+    public:
+        void apply(LimitBackend &backend) const {
+            const LimitValues values{
+                .stapm_limit = limit_scale(stapm_limit_),
+                .fast_limit  = limit_scale(fast_limit_),
+                .slow_limit  = limit_scale(slow_limit_),
+                .tctl_temp   = tctl_temp_.has_value() ? std::optional<std::uint32_t>{limit_scale(tctl_temp_.value())} : std::nullopt,
+            };
+
+            backend.apply(values);
+        }
+
         void parse(const jsn& input) {
             stapm_limit_ = input.at("stapm_limit").get<float>();
             fast_limit_ = input.at("fast_limit").get<float>();
@@ -98,6 +295,8 @@ namespace CPUPowerlimit {
         float fast_multiplier;
         float slow_multiplier;
 
+        std::string backend{"auto"};
+
         std::map<std::string, LimitProfile> profiles;
 
         void read() {
@@ -115,6 +314,10 @@ namespace CPUPowerlimit {
             fast_multiplier = config_data.at("fast_multiplier").get<float>();
             slow_multiplier = config_data.at("slow_multiplier").get<float>();
 
+            if (config_data.contains("backend")) {
+                backend = config_data.at("backend").get<std::string>();
+            }
+
             bool has_default = false;
 
             for (auto &profile : config_data.at("profiles").items()) {
@@ -207,7 +410,11 @@ int main(int argc, char *argv[]) {
         throw std::system_error(EBUSY, std::generic_category());
     }
 
-    limit_profile.apply();
+    auto backend = make_backend(limit_config.backend);
+
+    std::cout << "info: using CPU powerlimit backend: " << backend->name() << std::endl;
+
+    limit_profile.apply(*backend);
 
     if (!is_init) {
         const auto signal_handler = [](int signal) {
@@ -221,7 +428,7 @@ int main(int argc, char *argv[]) {
 
         std::cout << "info: restoring CPU powerlimit to defaults..." << std::endl;
 
-        def_profile.apply();
+        def_profile.apply(*backend);
     }
 
     powerlimit_lock.unlock();
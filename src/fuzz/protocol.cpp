@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "brightness_utils/protocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+
+namespace ProtocolFuzz {
+
+    using namespace BrightnessDaemon;
+
+    /**
+     * Handler that accepts every command, so that only the parser is exercised.
+     */
+    struct NullHandler {
+        void onCommand(CommandType type) {
+            // Also covers the string table for every type that passes validation.
+            static_cast<void>(to_string(type));
+        }
+
+        void onSetState(std::uint32_t) {}
+        void onModifyState(std::int32_t) {}
+        void onSaveState() {}
+        void onRestoreState() {}
+        void onSetPowersave() {}
+        void onSelectTarget(std::uint8_t) {}
+        void onGetStats() {}
+        void onStep(int) {}
+        void onGetState() {}
+        void onSubscribe() {}
+        void onUnsubscribe() {}
+    };
+
+} // namespace ProtocolFuzz
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+    using namespace ProtocolFuzz;
+
+    // The daemon never sees more than this in a single receive.
+    if (size > ::detail::kBufferSize) {
+        return -1;
+    }
+
+    NullHandler handler;
+
+    try {
+        parse_datagram(std::span{data, size}, handler);
+    } catch (const std::runtime_error &) {
+        // Rejected content is the expected outcome for most inputs.
+    }
+
+    return 0;
+}